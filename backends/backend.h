@@ -1,4 +1,11 @@
+#include "pixel_buffer.h"
+
 #include <SFML/Graphics.hpp>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -9,9 +16,137 @@ struct TOCEntry {
     int page, level;
 };
 
+// A page's text layer, for search: its characters in reading order as
+// UTF-8, and the box on the page at zoom 1 each byte's character covers.
+// Lines are joined with spaces, which have empty boxes.
+struct PageText {
+    std::string text;
+    std::vector<sf::FloatRect> boxes; // one per byte of text
+};
+
+struct RenderCancelled : std::runtime_error {
+    RenderCancelled()
+        : std::runtime_error("render cancelled") { }
+};
+
+// Handed to a render so whoever asked for it can call it off once the user
+// has moved on. Backends poll it between stages, and can hook it up to their
+// library's own abort flag with on_cancel(); either way a cancelled render
+// ends by throwing RenderCancelled.
+class RenderToken {
+private:
+    std::atomic<bool> cancelled = false;
+    std::mutex mutex;
+    std::list<std::function<void()>> hooks;
+
+public:
+    // Runs `hook` on cancel() for as long as the returned object lives, or
+    // right away if the token is already cancelled.
+    class Hook {
+        RenderToken* token;
+        std::list<std::function<void()>>::iterator it;
+
+    public:
+        Hook(RenderToken* token, std::function<void()> hook)
+            : token { token } {
+            if (!token) {
+                return;
+            }
+            std::lock_guard lock(token->mutex);
+            if (token->cancelled) {
+                hook();
+            }
+            it = token->hooks.insert(token->hooks.end(), std::move(hook));
+        }
+        ~Hook() {
+            if (token) {
+                std::lock_guard lock(token->mutex);
+                token->hooks.erase(it);
+            }
+        }
+        Hook(const Hook&) = delete;
+        Hook& operator=(const Hook&) = delete;
+    };
+
+    void cancel() {
+        std::lock_guard lock(mutex);
+        cancelled = true;
+        for (auto& hook : hooks) {
+            hook();
+        }
+    }
+
+    bool is_cancelled() const {
+        return cancelled;
+    }
+
+    // Throws if `token` (which may be null) has been cancelled.
+    static void check(const RenderToken* token) {
+        if (token && token->cancelled) {
+            throw RenderCancelled();
+        }
+    }
+};
+
+// Every method may be called from any thread, including several threads at
+// once: the viewer renders pages on a pool of workers without holding a lock
+// of its own. Backends whose underlying library can't do that must serialise
+// the affected calls internally.
 class Backend {
 public:
-    virtual sf::Image render_page(int page_number, float zoom, bool subpixel) = 0;
+    virtual ~Backend() = default;
+
+    // Size in pixels of the page rendered at `zoom`.
+    virtual sf::Vector2u page_size(int page_number, float zoom) = 0;
+
+    // Size of the page at zoom 1, for laying out the whole document. Unlike
+    // page_size() this shouldn't do any of the work of rendering the page,
+    // since every page gets measured.
+    virtual sf::Vector2f measure_page(int page_number) {
+        return sf::Vector2f(page_size(page_number, 1));
+    }
+
+    // Renders `region` of the page at `zoom` into `out`, which the caller
+    // has sized to the region. The region must lie within page_size(), and
+    // may be all of it or a tile of a deeply zoomed page.
+    virtual void render_into(int page_number, float zoom, bool subpixel, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) = 0;
+
+    // Like render_into() without subpixel rendering, for a quick look at a
+    // page that's about to be rendered again at `final_zoom`. Backends that
+    // keep work between renders can do it for the final render up front.
+    virtual void render_preview(int page_number, float zoom, float final_zoom, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) {
+        render_into(page_number, zoom, false, region, out, token);
+    }
+
+    // Like render_into() without subpixel rendering, for a small render of a
+    // page that may not be read: every page gets one, so backends shouldn't
+    // keep anything for it that could push out the pages being read.
+    virtual void render_thumbnail(int page_number, float zoom, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) {
+        render_into(page_number, zoom, false, region, out, token);
+    }
+
+    // Convenience versions of render_into() that allocate the result.
+    sf::Image render_region(int page_number, float zoom, bool subpixel, sf::IntRect region, RenderToken* token = nullptr) {
+        sf::Vector2u size(region.size);
+        std::vector<uint8_t> pixels((size_t)size.x * size.y * 4);
+        PixelBuffer out = { size, (size_t)size.x * 4, pixels.data() };
+        render_into(page_number, zoom, subpixel, region, out, token);
+        return sf::Image(size, pixels.data());
+    }
+
+    sf::Image render_page(int page_number, float zoom, bool subpixel, RenderToken* token = nullptr) {
+        sf::Vector2u size = page_size(page_number, zoom);
+        return render_region(page_number, zoom, subpixel, sf::IntRect({ 0, 0 }, sf::Vector2i(size)), token);
+    }
+
+    // Pages without a text layer, or backends without text at all, have
+    // empty text.
+    virtual PageText page_text(int page_number, RenderToken* token = nullptr) { return {}; };
+
+    // Memory the backend holds on to between renders that the viewer should
+    // count against its own render cache.
+    virtual size_t cached_bytes() { return 0; };
+
     virtual std::vector<TOCEntry> load_outline() { return {}; };
     virtual int count_pages() = 0;
 };
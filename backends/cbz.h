@@ -1,187 +1,101 @@
 #include "backend.h"
+#include "image_decoder.h"
+#include "pyramid.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cmath>
 #include <cstring>
+#include <future>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <variant>
 #include <zip.h>
 
 #pragma once
 
-double gaussian_kernel[5][5];
-void init_gaussian_kernel(double sigma) {
-    double a[5];
-    for (int i = -2; i < 3; ++i) {
-        a[i + 2] = exp(-.5 * i * i / (sigma * sigma));
-    }
-
-    double sum = 0;
-    for (int y = 0; y < 5; ++y) {
-        for (int x = 0; x < 5; ++x) {
-            gaussian_kernel[y][x] = a[y] * a[x];
-            sum += gaussian_kernel[y][x];
-        }
-    }
-
-    // normalize
-    for (int y = 0; y < 5; ++y) {
-        for (int x = 0; x < 5; ++x) {
-            gaussian_kernel[y][x] /= sum;
-        }
-    }
-}
-
 class CBZ : public Backend {
 private:
     std::vector<std::string> pages;
     zip_t* zip;
 
-    // Follows the definition on Wikipedia:
-    // https://en.wikipedia.org/wiki/Lanczos_resampling
-    double lanczos2(double x) {
-        constexpr double a = 2;
-        if (x == 0)
-            return 1;
-        else if (-a <= x && x < a)
-            return a * sin(M_PI * x) * sin(M_PI * x / a) / (M_PI * M_PI * x * x);
-        else
-            return 0;
-    }
+    // libzip archives aren't thread-safe. Decoding the image doesn't need
+    // the lock; zip_mutex also guards the decoded pages and stats below.
+    std::mutex zip_mutex;
 
-    sf::Image resize(sf::Image img, float zoom) {
-        // src & out data are len(w * h * 4); 4 channels, RGBA.
-        auto [src_w, src_h] = img.getSize();
-        const uint8_t* src_data = img.getPixelsPtr();
-
-        if (zoom < 1.0) { // if downsampling apply gaussian blur for better results
-            init_gaussian_kernel(0.5 * (1.0 / zoom));
-            // init_gaussian_kernel(0.3 * (1.0 / zoom) + 0.8);
-            uint8_t* filtered_src_data = (uint8_t*)malloc(src_w * src_h * 4);
-
-#pragma omp parallel for
-            for (int y = 0; y < src_h; ++y) {
-                for (int x = 0; x < src_w; ++x) {
-                    int y_lo = y - 2;
-                    if (y_lo < 0)
-                        y_lo = 0;
-                    int y_hi = y + 2;
-                    if (y_hi > src_h - 1)
-                        y_hi = src_h - 1;
-
-                    int x_lo = x - 2;
-                    if (x_lo < 0)
-                        x_lo = 0;
-                    int x_hi = x + 2;
-                    if (x_hi > src_w - 1)
-                        x_hi = src_w - 1;
-
-                    double r = 0, g = 0, b = 0;
-                    for (int ky = y_lo; ky <= y_hi; ++ky) {
-                        for (int kx = x_lo; kx <= x_hi; ++kx) {
-                            r += (double)src_data[(ky * src_w + kx) * 4 + 0] * gaussian_kernel[ky - y_lo][kx - x_lo];
-                            g += (double)src_data[(ky * src_w + kx) * 4 + 1] * gaussian_kernel[ky - y_lo][kx - x_lo];
-                            b += (double)src_data[(ky * src_w + kx) * 4 + 2] * gaussian_kernel[ky - y_lo][kx - x_lo];
-                        }
-                    }
-
-                    filtered_src_data[(y * src_w + x) * 4 + 0] = (int)r;
-                    filtered_src_data[(y * src_w + x) * 4 + 1] = (int)g;
-                    filtered_src_data[(y * src_w + x) * 4 + 2] = (int)b;
-                    filtered_src_data[(y * src_w + x) * 4 + 3] = 255;
-                }
-            }
-            src_data = filtered_src_data;
-        }
+public:
+    struct DecodeStats {
+        size_t hits = 0, misses = 0, evictions = 0;
+        size_t entries = 0, bytes = 0;
+        size_t decodes = 0, resamples = 0;
+        double last_decode_ms = 0, average_decode_ms = 0; // averages over about the last 32
+        double last_resample_ms = 0, average_resample_ms = 0;
+    };
+
+    // Decoded pages, so changing the zoom only resamples. Counts the decoded
+    // images; their smaller levels count against the viewer's render cache
+    // instead (see cached_bytes()).
+    size_t decoded_budget = 256 << 20;
 
-        unsigned int out_w = src_w * zoom;
-        unsigned int out_h = src_h * zoom;
-        uint8_t* out_data = (uint8_t*)malloc(out_w * out_h * 4);
-
-        // For each output pixel we can map/scale it to a corresponding
-        // position in the source image; we then take the five nearest pixels
-        // to this position and compute their distances, and we apply the
-        // lanczos function to these distances (its called lanczos resampling,
-        // after all). The resulting numbers are called "weights."
-        //
-        // This is a memoization/caching step -- computing lanczos2 25-times
-        // for each output pixel (x,y) is expensive, but by mapping the output
-        // pixel to a position in the source image and pre-computing the
-        // weights we gain huge savings/speedups.
-        struct KernelEntry {
-            int lo, hi;
-            double weights[5];
-        };
+private:
+    // Futures, so renders of a page that's still being decoded wait for it
+    // instead of decoding it again; the tiles of a deeply zoomed page are
+    // rendered all at once.
+    //
+    // JPEGs are decoded as small as the zoom they're first drawn at allows
+    // (see jpeg_reduction()); zooming further in than that decodes the page
+    // again, bigger, in place of the old entry.
+    using Decoded = std::shared_future<std::shared_ptr<ImagePyramid>>;
+    struct DecodedPage {
+        int reduction;
+        Decoded image;
+        size_t id; // tells a decode its own entry from one that replaced it
+    };
+    std::list<std::pair<int, DecodedPage>> decoded; // most recent first
+    std::unordered_map<int, decltype(decoded)::iterator> decoded_index;
+    size_t next_id = 0;
+
+    // enough for the header of all but JPEGs with huge metadata, which are
+    // measured by decoding them instead.
+    static constexpr size_t HEADER_BYTES = 128 << 10;
+    std::vector<sf::Vector2u> sizes; // of pages decoded so far, or 0
+    DecodeStats stats;
+    // the smaller levels of every pyramid still alive, kept by the pyramids
+    // themselves so reading it doesn't wait on the archive.
+    std::shared_ptr<std::atomic<size_t>> level_bytes = std::make_shared<std::atomic<size_t>>(0);
+
+    static bool is_ready(const Decoded& entry) {
+        return entry.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
 
-        // compute the weights in the y-direction.
-        struct KernelEntry weights_ys[out_h];
-        for (int y = 0; y < out_h; ++y) {
-            double srcY = (double)y / zoom;
-
-            int lo = ceil(srcY - 3);
-            if (lo < 0)
-                lo = 0;
-            int hi = floor(srcY + 3 - 1e-6f);
-            if (hi > src_h - 1)
-                hi = src_h - 1;
-            assert(hi - lo <= 5);
-
-            weights_ys[y] = (struct KernelEntry) { lo, hi };
-            for (int y_ = lo; y_ <= hi; ++y_) {
-                weights_ys[y].weights[y_ - lo] = lanczos2(y_ - srcY);
-            }
-        }
+    static double average(double average, double ms, size_t count) {
+        return average + (ms - average) / std::min<size_t>(count, 32);
+    }
 
-        // compute the weights in the x-direction.
-        struct KernelEntry weights_xs[out_w];
-        for (int x = 0; x < out_w; ++x) {
-            double srcX = (double)x / zoom;
-
-            int lo = ceil(srcX - 3);
-            if (lo < 0)
-                lo = 0;
-            int hi = floor(srcX + 3 - 1e-6f);
-            if (hi > src_w - 1)
-                hi = src_w - 1;
-            assert(hi - lo <= 5);
-
-            weights_xs[x] = (struct KernelEntry) { lo, hi };
-            for (int x_ = lo; x_ <= hi; ++x_) {
-                weights_xs[x].weights[x_ - lo] = lanczos2(x_ - srcX);
-            }
+    // Caller must hold zip_mutex. Pages still being decoded count as empty.
+    void evict() {
+        auto bytes = [](const Decoded& entry) {
+            return is_ready(entry) ? entry.get()->image_bytes() : 0;
+        };
+        stats.bytes = 0;
+        for (auto& [_, entry] : decoded) {
+            stats.bytes += bytes(entry.image);
         }
-
-        // loop through each output pixel
-#pragma omp parallel for
-        for (int y = 0; y < out_h; ++y) {
-            for (int x = 0; x < out_w; ++x) {
-                int out_i = (y * out_w + x) * 4;
-                out_data[out_i + 3] = 255; // alpha = 255
-
-                // loop through each color channel independently (RGB)
-                for (int channel = 0; channel < 3; ++channel) {
-                    double sum = 0;
-                    double total_weight = 0;
-
-                    // compute the kernel stuff
-                    for (int y_ = weights_ys[y].lo; y_ <= weights_ys[y].hi; ++y_) {
-                        for (int x_ = weights_xs[x].lo; x_ <= weights_xs[x].hi; ++x_) {
-                            double wy = weights_ys[y].weights[y_ - weights_ys[y].lo];
-                            double wx = weights_xs[x].weights[x_ - weights_xs[x].lo];
-
-                            double weight = wx * wy;
-                            sum += src_data[(y_ * src_w + x_) * 4 + channel] * weight;
-                            total_weight += weight;
-                        }
-                    }
-                    out_data[out_i + channel] = std::clamp((int)(sum / total_weight), 0, 255);
-                }
-            }
+        // always keep at least the most recently used page.
+        while (decoded.size() > 1 && stats.bytes > decoded_budget) {
+            stats.bytes -= bytes(decoded.back().second.image);
+            decoded_index.erase(decoded.back().first);
+            decoded.pop_back();
+            stats.evictions += 1;
         }
-
-        return sf::Image({ out_w, out_h }, out_data);
     }
 
 public:
@@ -232,31 +146,184 @@ public:
         for (const auto& page : pages) {
             std::cout << page << std::endl;
         }
+        sizes.resize(pages.size());
     }
 
-    sf::Image render_page(int page_number, float zoom, bool subpixel) override {
+private:
+    // The compressed image of a page, or its first `limit` bytes. Caller
+    // must hold zip_mutex.
+    std::vector<char> read(int page_number, size_t limit = SIZE_MAX) {
         zip_int64_t index = zip_name_locate(zip, pages[page_number].c_str(), 0);
+        zip_stat_t st;
         zip_file_t* file = zip_fopen_index(zip, index, 0);
+        std::vector<char> content;
+        if (file && zip_stat_index(zip, index, 0, &st) == 0 && (st.valid & ZIP_STAT_SIZE)) {
+            content.resize(std::min<zip_uint64_t>(st.size, limit));
+            zip_int64_t bytes_read = zip_fread(file, content.data(), content.size());
+            content.resize(std::max<zip_int64_t>(bytes_read, 0));
+        }
+        if (file) {
+            zip_fclose(file);
+        }
+        return content;
+    }
 
-        char buffer[4096];
-        zip_int64_t total_read = 0;
-        zip_int64_t bytes_read;
-        char* content = NULL;
-        size_t content_size = 0;
-
-        while ((bytes_read = zip_fread(file, buffer, sizeof(buffer))) > 0) {
-            char* new_content = (char*)realloc(content, content_size + bytes_read);
-            content = new_content;
-            memcpy(content + content_size, buffer, bytes_read);
-            content_size += bytes_read;
-            total_read += bytes_read;
+    // The page's size if it's known without decoding it: a JPEG's or PNG's
+    // is in its header, so only the start of it is even inflated.
+    std::optional<sf::Vector2u> header_size(int page_number) {
+        std::lock_guard lock(zip_mutex);
+        if (sizes[page_number] == sf::Vector2u()) {
+            sizes[page_number] = image_size(read(page_number, HEADER_BYTES)).value_or(sf::Vector2u());
         }
+        if (sizes[page_number] == sf::Vector2u()) {
+            return std::nullopt;
+        }
+        return sizes[page_number];
+    }
+
+    // Decodes a page at most `reduction` times smaller than it is, or finds
+    // it among the pages decoded before.
+    std::shared_ptr<ImagePyramid> decode(int page_number, int reduction) {
+        std::unique_lock lock(zip_mutex);
+        if (auto it = decoded_index.find(page_number); it != decoded_index.end()) {
+            if (it->second->second.reduction <= reduction) {
+                stats.hits += 1;
+                decoded.splice(decoded.begin(), decoded, it->second);
+                Decoded entry = it->second->second.image;
+                lock.unlock();
+                return entry.get();
+            }
+            // too small; anyone still waiting on it has their own copy.
+            decoded.erase(it->second);
+            decoded_index.erase(it);
+        }
+        stats.misses += 1;
+
+        std::promise<std::shared_ptr<ImagePyramid>> promise;
+        size_t id = next_id++;
+        decoded.push_front({ page_number, { reduction, promise.get_future().share(), id } });
+        decoded_index[page_number] = decoded.begin();
+        std::vector<char> content = read(page_number);
+        lock.unlock();
+
+        // the entry made above, unless it's since been evicted or replaced by
+        // a bigger decode. Caller must hold zip_mutex.
+        auto own_entry = [&]() -> DecodedPage* {
+            auto it = decoded_index.find(page_number);
+            return it != decoded_index.end() && it->second->second.id == id ? &it->second->second : nullptr;
+        };
 
-        zip_fclose(file);
+        auto t1 = std::chrono::steady_clock::now();
+        std::shared_ptr<ImagePyramid> res;
+        try {
+            res = std::make_shared<ImagePyramid>(decode_image(content, reduction), level_bytes);
+        } catch (...) {
+            // out of the cache first, so entries that are ready always have
+            // a page.
+            lock.lock();
+            if (own_entry()) {
+                decoded.erase(decoded_index[page_number]);
+                decoded_index.erase(page_number);
+            }
+            lock.unlock();
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+        // PNGs, and JPEGs libjpeg gave up on, come out bigger than asked for;
+        // mark the entry with what it really holds before it's used.
+        lock.lock();
+        if (DecodedPage* entry = own_entry()) {
+            entry->reduction = res->decoded_reduction();
+        }
+        lock.unlock();
+        promise.set_value(res);
+
+        lock.lock();
+        stats.decodes += 1;
+        stats.last_decode_ms = ms;
+        stats.average_decode_ms = average(stats.average_decode_ms, ms, stats.decodes);
+        sizes[page_number] = res->size();
+        evict();
+        return res;
+    }
+
+public:
+    sf::Vector2u page_size(int page_number, float zoom) override {
+        std::optional<sf::Vector2u> size = header_size(page_number);
+        auto [w, h] = size ? *size : decode(page_number, 8)->size();
+        return { (unsigned int)(w * zoom), (unsigned int)(h * zoom) };
+    }
+
+    // Like page_size(), but an image whose header doesn't say is decoded
+    // without keeping it, since every page gets measured.
+    sf::Vector2f measure_page(int page_number) override {
+        if (auto size = header_size(page_number)) {
+            return sf::Vector2f(*size);
+        }
+        std::unique_lock lock(zip_mutex);
+        std::vector<char> content = read(page_number);
+        lock.unlock();
+        sf::Vector2u size = decode_image(content, 8).full_size;
+        lock.lock();
+        sizes[page_number] = size;
+        return sf::Vector2f(size);
+    }
+
+    void render_into(int page_number, float zoom, bool subpixel, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) override {
+        render(page_number, zoom, jpeg_reduction(zoom), region, out, token);
+    }
+
+    // Decodes the page as big as the final render needs, which it then
+    // finds in the cache, rather than small for the preview and again.
+    void render_preview(int page_number, float zoom, float final_zoom, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) override {
+        render(page_number, zoom, jpeg_reduction(std::max(zoom, final_zoom)), region, out, token);
+    }
+
+    // Decoded on its own rather than into the cache, which would otherwise
+    // fill up with the whole archive; a page that's already there is used.
+    void render_thumbnail(int page_number, float zoom, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) override {
+        RenderToken::check(token);
+        int reduction = jpeg_reduction(zoom);
+        std::shared_ptr<ImagePyramid> img;
+        std::unique_lock lock(zip_mutex);
+        if (auto it = decoded_index.find(page_number); it != decoded_index.end()
+            && it->second->second.reduction <= reduction && is_ready(it->second->second.image)) {
+            img = it->second->second.image.get();
+            lock.unlock();
+        } else {
+            std::vector<char> content = read(page_number);
+            lock.unlock();
+            img = std::make_shared<ImagePyramid>(decode_image(content, reduction), level_bytes);
+        }
+        RenderToken::check(token);
+        img->render(zoom, region, out);
+    }
+
+private:
+    void render(int page_number, float zoom, int reduction, sf::IntRect region, PixelBuffer& out, RenderToken* token) {
+        RenderToken::check(token);
+        auto img = decode(page_number, reduction);
+        RenderToken::check(token);
+        auto t1 = std::chrono::steady_clock::now();
+        img->render(zoom, region, out);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+
+        std::lock_guard lock(zip_mutex);
+        stats.resamples += 1;
+        stats.last_resample_ms = ms;
+        stats.average_resample_ms = average(stats.average_resample_ms, ms, stats.resamples);
+    }
+
+public:
+    size_t cached_bytes() override {
+        return *level_bytes;
+    }
 
-        auto res = sf::Image(content, content_size);
-        free(content);
-        return resize(res, zoom);
+    DecodeStats decode_stats() {
+        std::lock_guard lock(zip_mutex);
+        stats.entries = decoded.size();
+        return stats;
     }
 
     int count_pages() override {
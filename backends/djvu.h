@@ -2,7 +2,9 @@
 
 #include <libdjvu/ddjvuapi.h>
 #include <libdjvu/miniexp.h>
+#include <mutex>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
 class DJVU : public Backend {
@@ -11,6 +13,10 @@ private:
     ddjvu_document_t* doc;
     int page_count;
 
+    // ddjvu contexts have a single message queue and aren't safe to drive
+    // from several threads, so page decoding and rendering are serialised.
+    std::mutex mutex;
+
     void handle_messages() {
         const ddjvu_message_t* msg;
         while ((msg = ddjvu_message_peek(ctx))) {
@@ -52,46 +58,118 @@ public:
         ddjvu_context_release(ctx);
     }
 
-    sf::Image render_page(int page_number, float zoom, bool subpixel) override {
+    sf::Vector2u page_size(int page_number, float zoom) override {
+        std::lock_guard lock(mutex);
+        ddjvu_pageinfo_t info;
+        ddjvu_status_t status;
+        while ((status = ddjvu_document_get_pageinfo(doc, page_number, &info)) < DDJVU_JOB_OK) {
+            handle_messages();
+        }
+        if (status != DDJVU_JOB_OK) {
+            throw std::runtime_error("Failed to get page info");
+        }
+        return { (unsigned int)(info.width * zoom), (unsigned int)(info.height * zoom) };
+    }
+
+    void render_into(int page_number, float zoom, bool subpixel, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) override {
+        RenderToken::check(token);
+        std::lock_guard lock(mutex);
         ddjvu_page_t* page = ddjvu_page_create_by_pageno(doc, page_number);
         if (!page) {
             throw std::runtime_error("Failed to create page");
         }
+        // check for cancellation between decoding and rendering.
         while (!ddjvu_page_decoding_done(page)) {
+            if (token && token->is_cancelled()) {
+                ddjvu_page_release(page);
+                throw RenderCancelled();
+            }
             handle_messages();
         }
+        if (token && token->is_cancelled()) {
+            ddjvu_page_release(page);
+            throw RenderCancelled();
+        }
 
-        unsigned int width = ddjvu_page_get_width(page) * zoom;
-        unsigned int height = ddjvu_page_get_height(page) * zoom;
-        ddjvu_rect_t rect { 0, 0, width, height };
-
-        // Create RGB format
-        ddjvu_format_t* format = ddjvu_format_create(DDJVU_FORMAT_RGB24, 0, nullptr);
+        // ddjvu scales the page to page_rect and renders only the part of it
+        // inside render_rect. Both are measured from the top once the format
+        // says so below; ddjvu counts y up from the bottom by default.
+        ddjvu_rect_t page_rect {
+            0, 0,
+            (unsigned int)(ddjvu_page_get_width(page) * zoom),
+            (unsigned int)(ddjvu_page_get_height(page) * zoom),
+        };
+        unsigned int width = region.size.x;
+        unsigned int height = region.size.y;
+        ddjvu_rect_t render_rect { region.position.x, region.position.y, width, height };
+
+        // Render straight to the RGBA bytes textures take: on a little
+        // endian machine those masks put red in the first byte, and xor-ing
+        // in the alpha bits makes the page opaque.
+        unsigned int masks[4] = { 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000 };
+        ddjvu_format_t* format = ddjvu_format_create(DDJVU_FORMAT_RGBMASK32, 4, masks);
         ddjvu_format_set_row_order(format, 1); // Top to bottom
+        ddjvu_format_set_y_direction(format, 1); // rects top down too
 
-        // Allocate pixel buffer & render
-        std::vector<unsigned char> pixels(width * height * 3);
-        unsigned char* buffer = pixels.data();
-        if (!ddjvu_page_render(page, DDJVU_RENDER_COLOR, &rect, &rect,
-                format, width * 3, (char*)buffer)) {
+        if (!ddjvu_page_render(page, DDJVU_RENDER_COLOR, &page_rect, &render_rect,
+                format, out.stride, (char*)out.pixels)) {
             ddjvu_format_release(format);
             ddjvu_page_release(page);
             throw std::runtime_error("Page rendering failed");
         }
 
         ddjvu_format_release(format);
+        ddjvu_page_release(page);
+    }
 
-        std::vector<unsigned char> out_pixels(width * height * 4, 255);
-        for (int i = 0; i < width * height; ++i) {
-            out_pixels[i * 4 + 0] = pixels[i * 3 + 0];
-            out_pixels[i * 4 + 1] = pixels[i * 3 + 1];
-            out_pixels[i * 4 + 2] = pixels[i * 3 + 2];
+    PageText page_text(int page_number, RenderToken* token = nullptr) override {
+        RenderToken::check(token);
+        std::lock_guard lock(mutex);
+        ddjvu_pageinfo_t info;
+        ddjvu_status_t status;
+        while ((status = ddjvu_document_get_pageinfo(doc, page_number, &info)) < DDJVU_JOB_OK) {
+            handle_messages();
         }
-        ddjvu_page_release(page);
-        return sf::Image({ width, height }, out_pixels.data());
+        miniexp_t text;
+        while ((text = ddjvu_document_get_pagetext(doc, page_number, "word")) == miniexp_dummy) {
+            handle_messages();
+        }
+
+        // (type x0 y0 x1 y1 child...) or (type x0 y0 x1 y1 "text"), in pixels
+        // from the bottom left corner. Words' boxes are shared by their
+        // bytes, since most DjVu files stop at words.
+        PageText page_text;
+        auto walk = [&](auto& me, miniexp_t node) -> void {
+            if (!miniexp_consp(node) || miniexp_length(node) < 6) {
+                return;
+            }
+            miniexp_t rest = miniexp_cdr(node);
+            float coords[4];
+            for (float& coord : coords) {
+                coord = miniexp_to_int(miniexp_car(rest));
+                rest = miniexp_cdr(rest);
+            }
+            if (miniexp_stringp(miniexp_car(rest))) {
+                std::string word = miniexp_to_str(miniexp_car(rest));
+                sf::FloatRect box({ coords[0], info.height - coords[3] }, { coords[2] - coords[0], coords[3] - coords[1] });
+                page_text.text += word + ' ';
+                page_text.boxes.insert(page_text.boxes.end(), word.size(), box);
+                page_text.boxes.emplace_back();
+                return;
+            }
+            for (; miniexp_consp(rest); rest = miniexp_cdr(rest)) {
+                me(me, miniexp_car(rest));
+            }
+        };
+        if (status == DDJVU_JOB_OK) {
+            walk(walk, text);
+        }
+        ddjvu_miniexp_release(doc, text);
+        return page_text;
     }
 
     std::vector<TOCEntry> load_outline() override {
+        std::lock_guard lock(mutex);
         std::vector<TOCEntry> entries;
         miniexp_t outline = ddjvu_document_get_outline(doc);
         if (outline == miniexp_nil) {
@@ -0,0 +1,171 @@
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <jpeglib.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#pragma once
+
+// Decodes the images CBZ pages are made of. JPEGs go through libjpeg-turbo,
+// which is several times quicker than SFML's loader and can decode straight
+// to a half, a quarter or an eighth of the size by scaling the DCT, which
+// saves most of the work for a page shown small. Anything else, or a JPEG
+// libjpeg gives up on, is left to SFML at full size.
+
+struct DecodedImage {
+    sf::Image image;
+    sf::Vector2u full_size;
+    // `image` is this many times smaller than `full_size`, rounded up; pixel
+    // i covers pixels [reduction * i, reduction * (i + 1)) of the full image.
+    int reduction;
+};
+
+// The most a JPEG can be reduced while decoding and still be at least `zoom`
+// times its full size.
+int jpeg_reduction(float zoom) {
+    int reduction = 1;
+    while (reduction < 8 && zoom * reduction * 2 <= 1) {
+        reduction *= 2;
+    }
+    return reduction;
+}
+
+bool is_jpeg(const std::vector<char>& content) {
+    return content.size() >= 3 && (uint8_t)content[0] == 0xff && (uint8_t)content[1] == 0xd8 && (uint8_t)content[2] == 0xff;
+}
+
+// libjpeg reports errors by calling error_exit, which mustn't return; jump
+// back out to the decoder instead of unwinding through C.
+struct JpegError {
+    jpeg_error_mgr mgr;
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+
+    static void exit(j_common_ptr cinfo) {
+        auto* error = (JpegError*)cinfo->err;
+        error->mgr.format_message(cinfo, error->message);
+        std::longjmp(error->jump, 1);
+    }
+};
+
+bool read_jpeg_header(jpeg_decompress_struct& cinfo, JpegError& err, const std::vector<char>& content) {
+    if (setjmp(err.jump)) {
+        return false;
+    }
+    jpeg_mem_src(&cinfo, (const unsigned char*)content.data(), content.size());
+    jpeg_read_header(&cinfo, TRUE);
+    return true;
+}
+
+// Decodes into `pixels`, which is sized to fit; false if libjpeg failed.
+// Everything this writes after setjmp() is outside its frame, so nothing is
+// left indeterminate when libjpeg jumps back.
+bool read_jpeg(jpeg_decompress_struct& cinfo, JpegError& err, const std::vector<char>& content, int reduction,
+    std::vector<uint8_t>& pixels) {
+    if (setjmp(err.jump)) {
+        return false;
+    }
+    jpeg_mem_src(&cinfo, (const unsigned char*)content.data(), content.size());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_EXT_RGBA;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = reduction;
+    jpeg_start_decompress(&cinfo);
+
+    pixels.resize((size_t)cinfo.output_width * cinfo.output_height * 4);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &pixels[(size_t)cinfo.output_scanline * cinfo.output_width * 4];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    return true;
+}
+
+// Decodes a JPEG `reduction` times smaller (1, 2, 4 or 8), or returns
+// nothing with the reason in `error`.
+std::optional<DecodedImage> decode_jpeg(const std::vector<char>& content, int reduction, std::string& error) {
+    jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = JpegError::exit;
+    jpeg_create_decompress(&cinfo);
+
+    std::vector<uint8_t> pixels;
+    std::optional<DecodedImage> decoded;
+    if (read_jpeg(cinfo, err, content, reduction, pixels)) {
+        decoded = DecodedImage {
+            sf::Image({ cinfo.output_width, cinfo.output_height }, pixels.data()),
+            { cinfo.image_width, cinfo.image_height },
+            reduction,
+        };
+    } else {
+        error = err.message;
+    }
+    jpeg_destroy_decompress(&cinfo);
+    return decoded;
+}
+
+// Full size of the image in `content` from its header, if it's a JPEG.
+// `content` only needs to be the start of the file, up to the frame header.
+std::optional<sf::Vector2u> jpeg_size(const std::vector<char>& content) {
+    if (!is_jpeg(content)) {
+        return std::nullopt;
+    }
+    jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = JpegError::exit;
+    err.mgr.emit_message = [](j_common_ptr, int) { }; // ending early isn't worth a warning
+    jpeg_create_decompress(&cinfo);
+
+    std::optional<sf::Vector2u> size;
+    if (read_jpeg_header(cinfo, err, content)) {
+        size = sf::Vector2u(cinfo.image_width, cinfo.image_height);
+    }
+    jpeg_destroy_decompress(&cinfo);
+    return size;
+}
+
+// Full size of the image in `content` from its IHDR chunk, which comes
+// first, if it's a PNG.
+std::optional<sf::Vector2u> png_size(const std::vector<char>& content) {
+    static const char signature[] = "\x89PNG\r\n\x1a\n\0\0\0\x0dIHDR";
+    if (content.size() < 24 || !std::equal(signature, signature + 16, content.begin())) {
+        return std::nullopt;
+    }
+    auto be32 = [&](int at) {
+        const uint8_t* p = (const uint8_t*)&content[at];
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    };
+    return sf::Vector2u(be32(16), be32(20));
+}
+
+// Full size of the image in `content`, which only needs to be the start of
+// the file, if it's a format whose header says.
+std::optional<sf::Vector2u> image_size(const std::vector<char>& content) {
+    if (auto size = png_size(content)) {
+        return size;
+    }
+    return jpeg_size(content);
+}
+
+// Decodes the image in `content`, `reduction` times smaller if it's a JPEG
+// and at full size otherwise.
+DecodedImage decode_image(const std::vector<char>& content, int reduction) {
+    if (is_jpeg(content)) {
+        std::string error;
+        if (auto decoded = decode_jpeg(content, reduction, error)) {
+            return std::move(*decoded);
+        }
+        std::cerr << "libjpeg: " << error << ", trying SFML" << std::endl;
+    }
+    sf::Image image(content.data(), content.size());
+    sf::Vector2u size = image.getSize();
+    return { std::move(image), size, 1 };
+}
@@ -1,4 +1,5 @@
 #include "backend.h"
+#include "subpixel.h"
 
 #include <SFML/Graphics.hpp>
 #include <mupdf/fitz.h>
@@ -6,25 +7,192 @@
 #include <mupdf/fitz/display-list.h>
 #include <mupdf/fitz/document.h>
 #include <mupdf/fitz/pixmap.h>
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <malloc.h>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #pragma once
 
 class PDF : public Backend {
 private:
-    fz_context* ctx;
+    fz_context* base_ctx;
     fz_document* doc;
 
     int page_count;
 
+    // A fz_context may only be used by one thread, so every thread that
+    // calls into the backend gets its own clone of base_ctx. The clones
+    // share the store and glyph cache, which is what the locks are for.
+    std::mutex fz_mutexes[FZ_LOCK_MAX];
+    fz_locks_context locks = {
+        fz_mutexes,
+        [](void* user, int lock) { ((std::mutex*)user)[lock].lock(); },
+        [](void* user, int lock) { ((std::mutex*)user)[lock].unlock(); },
+    };
+
+    std::mutex contexts_mutex;
+    std::unordered_map<std::thread::id, fz_context*> contexts;
+
+    fz_context* context() {
+        std::lock_guard lock(contexts_mutex);
+        fz_context*& ctx = contexts[std::this_thread::get_id()];
+        if (!ctx) {
+            ctx = fz_clone_context(base_ctx);
+            if (!ctx) {
+                throw std::runtime_error("cannot clone mupdf context");
+            }
+        }
+        return ctx;
+    }
+
+    // The document itself isn't thread-safe: loading pages, building display
+    // lists and walking the outline all happen under doc_mutex. Replaying a
+    // display list doesn't touch the document, so rasterization runs outside
+    // of it and several pages can be drawn at once.
+    std::mutex doc_mutex;
+
+    // MuPDF doesn't tell us how big a display list is, so count the bytes it
+    // allocates instead and charge whatever a page build leaves behind to
+    // that page's cache entry.
+    static inline thread_local size_t allocated_bytes = 0;
+
+    static void* counting_malloc(void*, size_t size) {
+        void* p = malloc(size);
+        if (p)
+            allocated_bytes += malloc_usable_size(p);
+        return p;
+    }
+    static void* counting_realloc(void*, void* old, size_t size) {
+        size_t old_size = old ? malloc_usable_size(old) : 0;
+        void* p = realloc(old, size);
+        if (p)
+            allocated_bytes += malloc_usable_size(p) - old_size;
+        return p;
+    }
+    static void counting_free(void*, void* p) {
+        if (p)
+            allocated_bytes -= malloc_usable_size(p);
+        free(p);
+    }
+    static inline fz_alloc_context counting_alloc = { NULL, counting_malloc, counting_realloc, counting_free };
+
+public:
+    struct DisplayListStats {
+        size_t hits = 0, misses = 0, evictions = 0;
+        size_t entries = 0, bytes = 0;
+    };
+
+    // Zooming, toggling subpixel rendering or resizing the window used to
+    // re-interpret the page's content stream each time. Instead we keep the
+    // page and a display list recorded at unit scale and only replay it.
+    size_t display_list_budget = 256 << 20;
+
+private:
+    struct CachedPage {
+        fz_page* page;
+        fz_display_list* list;
+        fz_rect bounds;
+        size_t cost;
+    };
+    std::list<std::pair<int, CachedPage>> display_lists; // most recent first
+    std::unordered_map<int, decltype(display_lists)::iterator> display_list_index;
+    DisplayListStats stats;
+
+    void drop_cached_page(fz_context* ctx, CachedPage& entry) {
+        fz_drop_display_list(ctx, entry.list);
+        fz_drop_page(ctx, entry.page);
+        stats.bytes -= entry.cost;
+    }
+
+    // Caller must hold doc_mutex.
+    const CachedPage& load_cached_page(fz_context* ctx, int page_number) {
+        if (auto it = display_list_index.find(page_number); it != display_list_index.end()) {
+            stats.hits += 1;
+            display_lists.splice(display_lists.begin(), display_lists, it->second);
+            return it->second->second;
+        }
+        stats.misses += 1;
+
+        fz_page* page = NULL;
+        fz_display_list* list = NULL;
+        fz_rect bounds;
+        size_t before = allocated_bytes;
+        fz_var(page);
+        fz_try(ctx) {
+            page = fz_load_page(ctx, doc, page_number);
+            bounds = fz_bound_page(ctx, page);
+            list = fz_new_display_list_from_page(ctx, page);
+        }
+        fz_catch(ctx) {
+            fz_drop_page(ctx, page);
+            fz_report_error(ctx);
+            throw std::runtime_error("failed to render page");
+        }
+        size_t cost = allocated_bytes > before ? allocated_bytes - before : 0;
+
+        // always keep at least the page we're about to draw.
+        while (!display_lists.empty() && stats.bytes + cost > display_list_budget) {
+            auto& [evicted_number, evicted] = display_lists.back();
+            drop_cached_page(ctx, evicted);
+            display_list_index.erase(evicted_number);
+            display_lists.pop_back();
+            stats.evictions += 1;
+        }
+
+        display_lists.push_front({ page_number, { page, list, bounds, cost } });
+        display_list_index[page_number] = display_lists.begin();
+        stats.bytes += cost;
+        return display_lists.front().second;
+    }
+
+    // A reference to the page's display list, from the cache if it's there
+    // and otherwise recorded for the caller alone, so passing over every page
+    // once doesn't push the pages being read out of the cache.
+    fz_display_list* keep_uncached_list(fz_context* ctx, int page_number, fz_rect& bounds) {
+        std::lock_guard lock(doc_mutex);
+        if (auto it = display_list_index.find(page_number); it != display_list_index.end()) {
+            bounds = it->second->second.bounds;
+            return fz_keep_display_list(ctx, it->second->second.list);
+        }
+        fz_page* page = NULL;
+        fz_display_list* list = NULL;
+        fz_var(page);
+        fz_try(ctx) {
+            page = fz_load_page(ctx, doc, page_number);
+            bounds = fz_bound_page(ctx, page);
+            list = fz_new_display_list_from_page(ctx, page);
+        }
+        fz_always(ctx) {
+            fz_drop_page(ctx, page);
+        }
+        fz_catch(ctx) {
+            fz_report_error(ctx);
+            throw std::runtime_error("failed to load page");
+        }
+        return list;
+    }
+
 public:
     ~PDF() {
-        fz_drop_document(ctx, doc);
-        fz_drop_context(ctx);
+        for (auto& [_, entry] : display_lists) {
+            drop_cached_page(base_ctx, entry);
+        }
+        fz_drop_document(base_ctx, doc);
+        for (auto& [_, ctx] : contexts) {
+            fz_drop_context(ctx);
+        }
+        fz_drop_context(base_ctx);
     }
 
     PDF(const char* filename) {
-        ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+        base_ctx = fz_new_context(&counting_alloc, &locks, FZ_STORE_DEFAULT);
+        fz_context* ctx = base_ctx;
         if (!ctx) {
             throw std::runtime_error("cannot create mupdf context");
         }
@@ -40,149 +208,187 @@ public:
         }
     }
 
-    sf::Image render_page(int page_number, float zoom, bool subpixel) override {
+    sf::Vector2u page_size(int page_number, float zoom) override {
+        fz_context* ctx = context();
+        std::lock_guard lock(doc_mutex);
+        fz_rect bounds = load_cached_page(ctx, page_number).bounds;
+        return { (unsigned int)(bounds.x1 * zoom), (unsigned int)(bounds.y1 * zoom) };
+    }
+
+    // Loads and bounds the page without recording a display list, which
+    // would interpret the whole content stream and push the pages being
+    // read out of the cache.
+    sf::Vector2f measure_page(int page_number) override {
+        fz_context* ctx = context();
+        std::lock_guard lock(doc_mutex);
+        if (auto it = display_list_index.find(page_number); it != display_list_index.end()) {
+            fz_rect bounds = it->second->second.bounds;
+            return { bounds.x1, bounds.y1 };
+        }
+        fz_page* page = NULL;
+        fz_rect bounds;
+        fz_var(page);
+        fz_try(ctx) {
+            page = fz_load_page(ctx, doc, page_number);
+            bounds = fz_bound_page(ctx, page);
+        }
+        fz_always(ctx) {
+            fz_drop_page(ctx, page);
+        }
+        fz_catch(ctx) {
+            fz_report_error(ctx);
+            throw std::runtime_error("failed to measure page");
+        }
+        return { bounds.x1, bounds.y1 };
+    }
+
+    void render_into(int page_number, float zoom, bool subpixel, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) override {
+        RenderToken::check(token);
+        fz_context* ctx = context();
+
+        // keep our own reference so the list survives being evicted by
+        // another thread while we draw it.
+        fz_display_list* list;
+        fz_rect bounds;
+        {
+            std::lock_guard lock(doc_mutex);
+            const CachedPage& cached = load_cached_page(ctx, page_number);
+            list = fz_keep_display_list(ctx, cached.list);
+            bounds = cached.bounds;
+        }
+        draw(ctx, list, bounds, zoom, subpixel, region, out, token);
+    }
+
+    void render_thumbnail(int page_number, float zoom, sf::IntRect region, PixelBuffer& out, RenderToken* token = nullptr) override {
+        RenderToken::check(token);
+        fz_context* ctx = context();
+        fz_rect bounds;
+        fz_display_list* list = keep_uncached_list(ctx, page_number, bounds);
+        draw(ctx, list, bounds, zoom, false, region, out, token);
+    }
+
+private:
+    // Draws `region` of the page at `zoom` from `list`, and drops the
+    // reference to it.
+    void draw(fz_context* ctx, fz_display_list* list, fz_rect bounds, float zoom, bool subpixel, sf::IntRect region, PixelBuffer& out, RenderToken* token) {
         // https://www.mail-archive.com/zathura@lists.pwmt.org/msg00344.html
         // http://arkanis.de/weblog/2023-08-14-simple-good-quality-subpixel-text-rendering-in-opengl-with-stb-truetype-and-dual-source-blending
 
-        fz_pixmap* pix;
-        { // render to (fz_pixmap *)pix, 3x width if subpixel rendering is enabled.
-            fz_display_list* list;
-            fz_device* dev = NULL;
+        // MuPDF polls the cookie while drawing, so cancelling stops it
+        // part way through the display list.
+        fz_cookie cookie = {};
+        RenderToken::Hook hook(token, [&] { cookie.abort = 1; });
 
-            fz_rect bbox;
-            fz_page* page;
-            fz_var(dev);
-            fz_try(ctx) {
-                page = fz_load_page(ctx, doc, page_number);
-                bbox = fz_bound_page(ctx, page);
-                bbox.x1 = (int)(bbox.x1 * zoom);
-                bbox.y1 = (int)(bbox.y1 * zoom);
-                bbox.x1 *= subpixel ? 3 : 1;
-                list = fz_new_display_list(ctx, bbox);
-
-                dev = fz_new_list_device(ctx, list);
-                fz_run_page(ctx, page, dev, fz_scale((subpixel ? 3 : 1) * zoom, 1 * zoom), NULL);
-            }
-            fz_always(ctx) {
-                fz_close_device(ctx, dev);
-                fz_drop_device(ctx, dev);
-                fz_drop_page(ctx, page);
-            }
-            fz_catch(ctx) {
-                fz_report_error(ctx);
-                throw std::runtime_error("failed to render page");
-            }
+        // The subpixel filter reads two samples either side of each pixel, so
+        // one extra pixel is rendered either side of the region.
+        int margin = subpixel ? 1 : 0;
+        int x0 = std::max(0, region.position.x - margin);
+        int x1 = std::min((int)(bounds.x1 * zoom), region.position.x + region.size.x + margin);
+
+        // Without subpixel rendering MuPDF draws straight into `out`: with an
+        // alpha channel, which the opaque white background sets to 255, the
+        // pixmap's samples are already RGBA. With subpixel rendering it draws
+        // an RGB pixmap three times as wide into a per-thread scratch buffer
+        // that the filter then reads.
+        thread_local std::vector<unsigned char> scratch;
+        int w = subpixel ? (x1 - x0) * 3 : region.size.x;
+        int h = region.size.y;
+        int n = subpixel ? 3 : 4;
+        int stride = subpixel ? w * n : out.stride;
+        unsigned char* samples = out.pixels;
+        if (subpixel) {
+            scratch.resize((size_t)stride * h);
+            samples = scratch.data();
+        }
+
+        fz_pixmap* pix = NULL;
+        { // render to (fz_pixmap *)pix, 3x width if subpixel rendering is enabled.
+            fz_matrix ctm = fz_concat(fz_scale((subpixel ? 3 : 1) * zoom, 1 * zoom),
+                fz_translate(-(subpixel ? x0 * 3 : region.position.x), -region.position.y));
+            fz_rect bbox = { 0, 0, (float)w, (float)h };
 
-            dev = NULL;
+            fz_device* dev = NULL;
             fz_var(dev);
+            fz_var(pix);
             fz_try(ctx) {
-                pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), fz_irect_from_rect(bbox), NULL, 0);
+                pix = fz_new_pixmap_with_data(ctx, fz_device_rgb(ctx), w, h, NULL, subpixel ? 0 : 1, stride, samples);
                 fz_clear_pixmap_with_value(ctx, pix, 0xff);
 
                 dev = fz_new_draw_device(ctx, fz_identity, pix);
-                fz_run_display_list(ctx, list, dev, fz_identity, bbox, NULL);
+                fz_run_display_list(ctx, list, dev, ctm, bbox, &cookie);
             }
             fz_always(ctx) {
                 fz_close_device(ctx, dev);
                 fz_drop_device(ctx, dev);
+                fz_drop_pixmap(ctx, pix); // doesn't own the samples
+                fz_drop_display_list(ctx, list);
             }
             fz_catch(ctx) {
+                if (cookie.abort) {
+                    throw RenderCancelled();
+                }
                 fz_report_error(ctx);
                 throw std::runtime_error("failed to render page");
             }
-            fz_drop_display_list(ctx, list);
+        }
+        if (cookie.abort) {
+            throw RenderCancelled();
         }
 
-        auto filter = [&](float x0, float x1, float x2, float x3, float x4) -> float {
-            return x0 * (1.0 / 9) + x1 * (2.0 / 9) + x2 * (3.0 / 9) + x3 * (2.0 / 9) + x4 * (1.0 / 9);
-            // float w1 = (float)0x08 / 256;
-            // float w2 = (float)0x4d / 256;
-            // float w3 = (float)0x56 / 256;
-            // return x0 * w1 + x1 * w2 + x2 * w3 + x3 * w2 + x4 * w1;
-        };
-        auto filter1 = [&](float x0, float x1, float x2, float x3, float x4) -> float {
-            float w1 = (float)0x08 / 256;
-            float w2 = (float)0x4d / 256;
-            float w3 = (float)0x56 / 256;
-            return x0 * w1 + x1 * w2 + x2 * w3 + x3 * w2 + x4 * w1;
-        };
-        auto filter2 = [&](float x0, float x1, float x2, float x3, float x4) -> float {
-            return x0 * (1.0 / 9) + x1 * (2.0 / 9) + x2 * (3.0 / 9) + x3 * (2.0 / 9) + x4 * (1.0 / 9);
-        };
+        if (subpixel) {
+            // the margin is cropped off by only writing the region's pixels.
+            subpixel_filter(samples, stride, n, x1 - x0, h, out.pixels, out.stride, region.position.x - x0, region.size.x);
+        }
+    }
 
-        // R: [0.15, 0.25, 0.3,  0.25, 0.15]
-        // G: [0.1,  0.3,  0.6,  0.3,  0.1]   ← Stronger center (green)
-        // B: [0.15, 0.25, 0.3,  0.25, 0.15]
-
-        unsigned int w
-            = subpixel ? pix->w / 3 : pix->w;
-        unsigned int h = pix->h;
-        unsigned char* output_pixels = new unsigned char[w * h * 4];
-
-        int i = 0;
-        for (int y = 0; y < h; ++y) {
-            unsigned char* p = &pix->samples[y * pix->stride];
-
-            if (subpixel) {
-                output_pixels[i * 4 + 0] = p[0];
-                output_pixels[i * 4 + 1] = p[1];
-                output_pixels[i * 4 + 2] = p[2];
-                output_pixels[i * 4 + 3] = 255;
-                i += 1;
-                p += pix->n * 3;
-
-                for (int x = 1; x < w - 1; ++x) {
-                    int n = pix->n;
-
-                    // p += 1;
-                    // float g = filter2(p[-n * 2], p[-n], p[0], p[n], p[n * 2]);
-                    // p += 1;
-                    // float b = filter1(p[-n * 2], p[-n], p[0], p[n], p[n * 2]);
-                    // p += 1;
-                    // float r = filter1(p[-n * 2], p[-n], p[0], p[n], p[n * 2]);
-
-                    p += 1;
-                    float r = filter(p[-n * 2], p[-n], p[0], p[n], p[n * 2]);
-                    p += 1;
-                    float g = filter(p[-n * 2], p[-n], p[0], p[n], p[n * 2]);
-                    p += 1;
-                    float b = filter(p[-n * 2], p[-n], p[0], p[n], p[n * 2]);
-
-                    output_pixels[i * 4 + 0] = (int)r;
-                    output_pixels[i * 4 + 1] = (int)g;
-                    output_pixels[i * 4 + 2] = (int)b;
-                    output_pixels[i * 4 + 3] = 255;
-
-                    i += 1;
-                    p += pix->n * 2;
-                }
+public:
+    PageText page_text(int page_number, RenderToken* token = nullptr) override {
+        RenderToken::check(token);
+        fz_context* ctx = context();
+
+        // Extract from a display list, outside doc_mutex like rendering,
+        // without caching it: indexing goes through the whole document.
+        fz_rect bounds;
+        fz_display_list* list = keep_uncached_list(ctx, page_number, bounds);
 
-                output_pixels[i * 4 + 0] = p[0];
-                output_pixels[i * 4 + 1] = p[1];
-                output_pixels[i * 4 + 2] = p[2];
-                output_pixels[i * 4 + 3] = 255;
-                i += 1;
-                p += pix->n * 3;
-            } else {
-                for (int x = 0; x < w; ++x) {
-                    output_pixels[i * 4 + 0] = p[0];
-                    output_pixels[i * 4 + 1] = p[1];
-                    output_pixels[i * 4 + 2] = p[2];
-                    output_pixels[i * 4 + 3] = 255;
-
-                    p += pix->n;
-                    i += 1;
+        PageText page_text;
+        fz_stext_page* stext = NULL;
+        fz_var(stext);
+        fz_try(ctx) {
+            stext = fz_new_stext_page_from_display_list(ctx, list, NULL);
+        }
+        fz_always(ctx) {
+            fz_drop_display_list(ctx, list);
+        }
+        fz_catch(ctx) {
+            fz_report_error(ctx);
+            throw std::runtime_error("failed to extract text");
+        }
+
+        for (fz_stext_block* block = stext->first_block; block; block = block->next) {
+            if (block->type != FZ_STEXT_BLOCK_TEXT) {
+                continue;
+            }
+            for (fz_stext_line* line = block->u.t.first_line; line; line = line->next) {
+                for (fz_stext_char* ch = line->first_char; ch; ch = ch->next) {
+                    char utf8[8];
+                    int n = fz_runetochar(utf8, ch->c);
+                    fz_rect r = fz_rect_from_quad(ch->quad);
+                    page_text.text.append(utf8, n);
+                    page_text.boxes.insert(page_text.boxes.end(), n, sf::FloatRect({ r.x0, r.y0 }, { r.x1 - r.x0, r.y1 - r.y0 }));
                 }
+                page_text.text += ' ';
+                page_text.boxes.emplace_back();
             }
         }
-        auto ret = sf::Image({ w, h }, output_pixels);
-        delete[] output_pixels;
-        fz_drop_pixmap(ctx, pix);
-
-        return ret;
+        fz_drop_stext_page(ctx, stext);
+        return page_text;
     }
 
     std::vector<TOCEntry> load_outline() override {
+        fz_context* ctx = context();
+        std::lock_guard lock(doc_mutex);
+
         std::vector<TOCEntry> toc;
         auto load_outline = [&](auto& me, fz_context* ctx, fz_outline* outline, int level) -> void {
             while (outline) {
@@ -211,4 +417,10 @@ public:
     int count_pages() override {
         return page_count;
     }
+
+    DisplayListStats display_list_stats() {
+        std::lock_guard lock(doc_mutex);
+        stats.entries = display_lists.size();
+        return stats;
+    }
 };
@@ -0,0 +1,24 @@
+#include <SFML/Graphics.hpp>
+#include <cstddef>
+#include <cstdint>
+
+#pragma once
+
+// RGBA pixels owned by someone else, row y starting at pixels + y * stride.
+// Backends render into these so the final pixels are written exactly once,
+// into memory the viewer recycles (see BufferPool).
+struct PixelBuffer {
+    sf::Vector2u size;
+    size_t stride;
+    uint8_t* pixels;
+
+    uint8_t* row(unsigned int y) {
+        return pixels + y * stride;
+    }
+    const uint8_t* row(unsigned int y) const {
+        return pixels + y * stride;
+    }
+    size_t bytes() const {
+        return size.y * stride;
+    }
+};
@@ -0,0 +1,130 @@
+#include "image_decoder.h"
+#include "pixel_buffer.h"
+#include "resample.h"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#pragma once
+
+// Box-filters `src` (packed RGBA rows of `size`) to half its size into
+// `dst`, rounding odd sizes up: the last row or column is averaged with
+// itself.
+void halve(const uint8_t* src, sf::Vector2u size, uint8_t* dst) {
+    int w = (size.x + 1) / 2, h = (size.y + 1) / 2;
+#pragma omp parallel for
+    for (int y = 0; y < h; ++y) {
+        const uint8_t* a = src + (size_t)(2 * y) * size.x * 4;
+        const uint8_t* b = src + (size_t)std::min(2 * y + 1, (int)size.y - 1) * size.x * 4;
+        uint8_t* out = dst + (size_t)y * w * 4;
+        for (int x = 0; x < w; ++x) {
+            int x0 = 2 * x * 4, x1 = std::min(2 * x + 1, (int)size.x - 1) * 4;
+            for (int c = 0; c < 4; ++c) {
+                out[x * 4 + c] = (a[x0 + c] + a[x1 + c] + b[x0 + c] + b[x1 + c] + 2) >> 2;
+            }
+        }
+    }
+}
+
+// A decoded image and, built the first time zooming out needs them, copies
+// box-filtered to a half, a quarter, ... of its size. A page shown small is
+// resampled from the smallest level that's still at least as big as the
+// output, so Lanczos never works on more than four source pixels per output
+// pixel however far out the page is zoomed.
+//
+// The image itself may have been decoded smaller than the page (see
+// DecodedImage); sizes and zooms here are always the full page's.
+class ImagePyramid {
+private:
+    struct Level {
+        sf::Vector2u size;
+        std::vector<uint8_t> pixels; // packed RGBA rows
+    };
+
+    sf::Image image;
+    sf::Vector2u full_size;
+    int reduction;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<const Level>> levels; // levels[k - 1] is halved k times
+    size_t level_bytes = 0;
+    std::shared_ptr<std::atomic<size_t>> total_level_bytes;
+
+    // Level `k` (at least 1), built along with any missing levels before it.
+    // Levels are never dropped, so the reference stays good for as long as
+    // the pyramid lives.
+    const Level& level(int k) {
+        std::lock_guard lock(mutex);
+        while (levels.size() < k) {
+            const uint8_t* src = levels.empty() ? image.getPixelsPtr() : levels.back()->pixels.data();
+            sf::Vector2u size = levels.empty() ? image.getSize() : levels.back()->size;
+
+            auto next = std::make_unique<Level>();
+            next->size = { (size.x + 1) / 2, (size.y + 1) / 2 };
+            next->pixels.resize((size_t)next->size.x * next->size.y * 4);
+            halve(src, size, next->pixels.data());
+            level_bytes += next->pixels.size();
+            if (total_level_bytes) {
+                *total_level_bytes += next->pixels.size();
+            }
+            levels.push_back(std::move(next));
+        }
+        return *levels[k - 1];
+    }
+
+public:
+    // The levels' bytes are added to `total_level_bytes`, if given, while
+    // the pyramid lives, so the memory of many pyramids can be read without
+    // going through them.
+    ImagePyramid(DecodedImage decoded, std::shared_ptr<std::atomic<size_t>> total_level_bytes = nullptr)
+        : image { std::move(decoded.image) }
+        , full_size { decoded.full_size }
+        , reduction { decoded.reduction }
+        , total_level_bytes { std::move(total_level_bytes) } { }
+
+    ~ImagePyramid() {
+        if (total_level_bytes) {
+            *total_level_bytes -= level_bytes;
+        }
+    }
+
+    sf::Vector2u size() const {
+        return full_size;
+    }
+
+    // How many times smaller than the page the decoded image is.
+    int decoded_reduction() const {
+        return reduction;
+    }
+
+    size_t image_bytes() const {
+        return (size_t)image.getSize().x * image.getSize().y * 4;
+    }
+
+    // Like resample() on the full page.
+    void render(float zoom, sf::IntRect region, PixelBuffer& out) {
+        // level k is 2^-k the size of the image, so it's used for zooms of
+        // 2^-k and below relative to the image.
+        int k = 0;
+        sf::Vector2u size = image.getSize();
+        while (zoom * reduction * (2 << k) <= 1 && (size.x > 1 || size.y > 1)) {
+            k += 1;
+            size = { (size.x + 1) / 2, (size.y + 1) / 2 };
+        }
+
+        // pixel i of the source covers pixels [scale i, scale (i + 1)) of the
+        // page, so its centre is (scale - 1) / 2 further along.
+        float scale = reduction << k;
+        float shift = -(scale - 1) / (2 * scale);
+        if (k == 0) {
+            resample(image.getPixelsPtr(), image.getSize(), zoom * scale, region, out, shift);
+            return;
+        }
+        const Level& source = level(k);
+        resample(source.pixels.data(), source.size, zoom * scale, region, out, shift);
+    }
+};
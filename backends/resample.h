@@ -0,0 +1,298 @@
+#include "pixel_buffer.h"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#pragma once
+
+// Resampling for pages that are only pixels (CBZ): a Lanczos-2 filter
+// applied separably, first along the rows and then down the columns, so
+// each output pixel costs 2n taps instead of n^2. When shrinking, the kernel
+// is stretched by 1 / zoom, which does the low-pass filtering a blur used to
+// do beforehand. Weights are 14-bit fixed point and each call computes its
+// own, so any number of pages can be resampled at once.
+//
+// On x86 the kernels come in SSE4.1 and AVX2 versions, compiled for those
+// instruction sets whatever the build targets and picked when first used,
+// so one binary runs everywhere and is fast where it can be.
+
+constexpr int RESAMPLE_BITS = 14;
+
+// Follows the definition on Wikipedia:
+// https://en.wikipedia.org/wiki/Lanczos_resampling
+inline double lanczos2(double x) {
+    constexpr double a = 2;
+    if (x == 0)
+        return 1;
+    else if (-a <= x && x < a)
+        return a * sin(M_PI * x) * sin(M_PI * x / a) / (M_PI * M_PI * x * x);
+    else
+        return 0;
+}
+
+// For each output pixel, the first source pixel it reads and `taps`
+// weights for it and the pixels after it.
+struct ResampleWeights {
+    int taps;
+    std::vector<int> first;
+    std::vector<int16_t> weights; // `taps` per output pixel, summing to 1 << RESAMPLE_BITS
+};
+
+// Weights for output pixels [offset, offset + count) of a line of `size`
+// source pixels scaled by `zoom`. Output pixel i is centred on source pixel
+// i / zoom + shift.
+ResampleWeights resample_weights(int size, float zoom, int offset, int count, float shift = 0) {
+    double stretch = std::max(1.0, 1.0 / zoom);
+    double support = 2 * stretch;
+
+    ResampleWeights w;
+    w.taps = std::min(2 * (int)ceil(support) + 1, size);
+    w.first.resize(count);
+    w.weights.resize((size_t)count * w.taps);
+
+    std::vector<double> exact(w.taps);
+    for (int i = 0; i < count; ++i) {
+        double center = (offset + i) / zoom + shift;
+        // near the edges the window slides inwards; taps past the support
+        // just get no weight.
+        int first = std::clamp((int)ceil(center - support), 0, size - w.taps);
+        double sum = 0;
+        for (int t = 0; t < w.taps; ++t) {
+            exact[t] = lanczos2((first + t - center) / stretch);
+            sum += exact[t];
+        }
+
+        // round so the weights sum to exactly one, putting the error on the
+        // biggest.
+        int16_t* weights = &w.weights[(size_t)i * w.taps];
+        int total = 0, biggest = 0;
+        for (int t = 0; t < w.taps; ++t) {
+            weights[t] = lround(exact[t] / sum * (1 << RESAMPLE_BITS));
+            total += weights[t];
+            biggest = weights[t] > weights[biggest] ? t : biggest;
+        }
+        weights[biggest] += (1 << RESAMPLE_BITS) - total;
+        w.first[i] = first;
+    }
+    return w;
+}
+
+inline uint8_t resample_round(int sum) {
+    return std::clamp((sum + (1 << (RESAMPLE_BITS - 1))) >> RESAMPLE_BITS, 0, 255);
+}
+
+// One row along x: `src` and `dst` are RGBA.
+void resample_row(const uint8_t* src, uint8_t* dst, const ResampleWeights& w) {
+    for (int x = 0; x < w.first.size(); ++x) {
+        const uint8_t* p = src + w.first[x] * 4;
+        const int16_t* weights = &w.weights[(size_t)x * w.taps];
+        int r = 0, g = 0, b = 0;
+        for (int t = 0; t < w.taps; ++t) {
+            r += p[t * 4 + 0] * weights[t];
+            g += p[t * 4 + 1] * weights[t];
+            b += p[t * 4 + 2] * weights[t];
+        }
+        dst[x * 4 + 0] = resample_round(r);
+        dst[x * 4 + 1] = resample_round(g);
+        dst[x * 4 + 2] = resample_round(b);
+        dst[x * 4 + 3] = 255;
+    }
+}
+
+// One row down the columns: `taps` rows of `bytes` bytes starting at `src`,
+// `stride` apart, weighed into `dst`.
+void resample_column(const uint8_t* src, size_t stride, const int16_t* weights, int taps, uint8_t* dst, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        int sum = 0;
+        for (int t = 0; t < taps; ++t) {
+            sum += src[t * stride + i] * weights[t];
+        }
+        dst[i] = resample_round(sum);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The SIMD kernels multiply pairs of 16-bit values with a pair of weights
+// and add them (madd), so two taps are done at once and the sums stay 32-bit.
+
+// Adds taps [t, taps) of one output pixel to `sum`, one lane per channel.
+__attribute__((target("sse4.1"))) inline __m128i resample_taps_sse41(
+    const uint8_t* p, const int16_t* weights, int t, int taps, __m128i sum) {
+    // two pixels' channels, interleaved as 16-bit pairs.
+    const __m128i pair = _mm_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1);
+    for (; t + 2 <= taps; t += 2) {
+        int32_t ws;
+        memcpy(&ws, &weights[t], sizeof(ws));
+        __m128i pixels = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i*)&p[t * 4]), pair);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, _mm_set1_epi32(ws)));
+    }
+    if (t < taps) {
+        int32_t pixel;
+        memcpy(&pixel, &p[t * 4], sizeof(pixel));
+        __m128i pixels = _mm_shuffle_epi8(_mm_cvtsi32_si128(pixel), pair);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, _mm_set1_epi32((uint16_t)weights[t])));
+    }
+    return sum;
+}
+
+__attribute__((target("sse4.1"))) inline void resample_store_sse41(__m128i sum, uint8_t* dst) {
+    sum = _mm_srai_epi32(sum, RESAMPLE_BITS);
+    __m128i packed = _mm_packus_epi16(_mm_packs_epi32(sum, sum), sum);
+    int32_t pixel = _mm_cvtsi128_si32(_mm_or_si128(packed, _mm_set1_epi32(0xff000000)));
+    memcpy(dst, &pixel, sizeof(pixel));
+}
+
+__attribute__((target("sse4.1"))) void resample_row_sse41(const uint8_t* src, uint8_t* dst, const ResampleWeights& w) {
+    const __m128i half = _mm_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    for (int x = 0; x < w.first.size(); ++x) {
+        __m128i sum = resample_taps_sse41(src + w.first[x] * 4, &w.weights[(size_t)x * w.taps], 0, w.taps, half);
+        resample_store_sse41(sum, dst + x * 4);
+    }
+}
+
+__attribute__((target("avx2"))) void resample_row_avx2(const uint8_t* src, uint8_t* dst, const ResampleWeights& w) {
+    // four taps at once: two pixels in each half.
+    const __m256i quad = _mm256_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1,
+        8, -1, 12, -1, 9, -1, 13, -1, 10, -1, 14, -1, 11, -1, 15, -1);
+    const __m256i spread = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const __m128i half = _mm_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    for (int x = 0; x < w.first.size(); ++x) {
+        const uint8_t* p = src + w.first[x] * 4;
+        const int16_t* weights = &w.weights[(size_t)x * w.taps];
+        __m256i sums = _mm256_setzero_si256();
+        int t = 0;
+        for (; t + 4 <= w.taps; t += 4) {
+            __m256i pixels = _mm256_shuffle_epi8(
+                _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&p[t * 4])), quad);
+            __m256i ws = _mm256_permutevar8x32_epi32(
+                _mm256_castsi128_si256(_mm_loadl_epi64((const __m128i*)&weights[t])), spread);
+            sums = _mm256_add_epi32(sums, _mm256_madd_epi16(pixels, ws));
+        }
+        __m128i sum = _mm_add_epi32(half,
+            _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1)));
+        resample_store_sse41(resample_taps_sse41(p, weights, t, w.taps, sum), dst + x * 4);
+    }
+}
+
+__attribute__((target("sse4.1"))) void resample_column_sse41(
+    const uint8_t* src, size_t stride, const int16_t* weights, int taps, uint8_t* dst, int bytes) {
+    const __m128i half = _mm_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i sums[4] = { half, half, half, half };
+        for (int t = 0; t < taps; t += 2) {
+            // rows t and t + 1, their bytes interleaved.
+            __m128i a = _mm_loadu_si128((const __m128i*)&src[t * stride + i]);
+            __m128i b = t + 1 < taps ? _mm_loadu_si128((const __m128i*)&src[(t + 1) * stride + i]) : zero;
+            __m128i ws = _mm_set1_epi32((uint16_t)weights[t] | (t + 1 < taps ? (uint32_t)(uint16_t)weights[t + 1] << 16 : 0));
+            __m128i lo = _mm_unpacklo_epi8(a, b), hi = _mm_unpackhi_epi8(a, b);
+            sums[0] = _mm_add_epi32(sums[0], _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), ws));
+            sums[1] = _mm_add_epi32(sums[1], _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), ws));
+            sums[2] = _mm_add_epi32(sums[2], _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), ws));
+            sums[3] = _mm_add_epi32(sums[3], _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), ws));
+        }
+        for (auto& sum : sums) {
+            sum = _mm_srai_epi32(sum, RESAMPLE_BITS);
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]), _mm_packs_epi32(sums[2], sums[3]));
+        _mm_storeu_si128((__m128i*)&dst[i], packed);
+    }
+    resample_column(src + i, stride, weights, taps, dst + i, bytes - i);
+}
+
+__attribute__((target("avx2"))) void resample_column_avx2(
+    const uint8_t* src, size_t stride, const int16_t* weights, int taps, uint8_t* dst, int bytes) {
+    const __m256i half = _mm256_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    // the unpacks work within each 16-byte half, so the sums end up back in
+    // order once packed.
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i sums[4] = { half, half, half, half };
+        for (int t = 0; t < taps; t += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)&src[t * stride + i]);
+            __m256i b = t + 1 < taps ? _mm256_loadu_si256((const __m256i*)&src[(t + 1) * stride + i]) : zero;
+            __m256i ws = _mm256_set1_epi32((uint16_t)weights[t] | (t + 1 < taps ? (uint32_t)(uint16_t)weights[t + 1] << 16 : 0));
+            __m256i lo = _mm256_unpacklo_epi8(a, b), hi = _mm256_unpackhi_epi8(a, b);
+            sums[0] = _mm256_add_epi32(sums[0], _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), ws));
+            sums[1] = _mm256_add_epi32(sums[1], _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), ws));
+            sums[2] = _mm256_add_epi32(sums[2], _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), ws));
+            sums[3] = _mm256_add_epi32(sums[3], _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), ws));
+        }
+        for (auto& sum : sums) {
+            sum = _mm256_srai_epi32(sum, RESAMPLE_BITS);
+        }
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(sums[0], sums[1]), _mm256_packs_epi32(sums[2], sums[3]));
+        _mm256_storeu_si256((__m256i*)&dst[i], packed);
+    }
+    resample_column_sse41(src + i, stride, weights, taps, dst + i, bytes - i);
+}
+#endif
+
+struct ResampleKernels {
+    void (*row)(const uint8_t* src, uint8_t* dst, const ResampleWeights& w);
+    void (*column)(const uint8_t* src, size_t stride, const int16_t* weights, int taps, uint8_t* dst, int bytes);
+};
+
+// The fastest kernels the CPU we're running on has.
+const ResampleKernels& resample_kernels() {
+    static const ResampleKernels kernels = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2")) {
+            return ResampleKernels { resample_row_avx2, resample_column_avx2 };
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return ResampleKernels { resample_row_sse41, resample_column_sse41 };
+        }
+#endif
+        return ResampleKernels { resample_row, resample_column };
+    }();
+    return kernels;
+}
+
+// Writes the part of the `size` RGBA image at `src` (packed rows) scaled by
+// `zoom` that lies inside `region` to `out`, as opaque RGBA. `shift` is as
+// for resample_weights().
+void resample(const uint8_t* src, sf::Vector2u size, float zoom, sf::IntRect region, PixelBuffer& out, float shift = 0) {
+    const ResampleKernels& kernels = resample_kernels();
+    ResampleWeights xs = resample_weights(size.x, zoom, region.position.x, region.size.x, shift);
+    ResampleWeights ys = resample_weights(size.y, zoom, region.position.y, region.size.y, shift);
+    if (region.size.y == 0) {
+        return;
+    }
+
+    // bands of output rows are done start to finish by one thread each, so
+    // each thread's rows resampled along x stay about BAND_ROWS source rows
+    // however big the region is; bands next to each other redo the few
+    // source rows they share.
+    constexpr int BAND_ROWS = 128;
+    int band = std::max(1, (int)(BAND_ROWS * std::min(zoom, 1.0f)));
+    int bands = (region.size.y + band - 1) / band;
+    size_t stride = (size_t)region.size.x * 4;
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < bands; ++b) {
+        int y0 = b * band, y1 = std::min(y0 + band, region.size.y);
+        int row_lo = ys.first[y0], row_hi = ys.first[y1 - 1] + ys.taps;
+        thread_local std::vector<uint8_t> scratch;
+        scratch.resize((row_hi - row_lo) * stride);
+
+        // first pass: the source rows the band needs, resampled along x.
+        for (int y = row_lo; y < row_hi; ++y) {
+            kernels.row(src + (size_t)y * size.x * 4, scratch.data() + (y - row_lo) * stride, xs);
+        }
+        // second pass: down the columns.
+        for (int y = y0; y < y1; ++y) {
+            kernels.column(scratch.data() + (ys.first[y] - row_lo) * stride, stride, &ys.weights[(size_t)y * ys.taps],
+                ys.taps, out.row(y), stride);
+        }
+    }
+}
@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#pragma once
+
+// Subpixel rendering: the page is rendered at three times its width, and
+// each output pixel's red, green and blue are taken from its three columns
+// after a 5-tap low-pass filter [1 2 3 2 1] / 9 across neighbouring columns
+// of the same channel, so text edges don't get coloured fringes.
+//
+// Rows come in as `N` bytes per column (3 for RGB, 4 with alpha) and go out
+// as RGBA. Indexing the colour samples of a row j = 0, 1, 2, ... regardless
+// of N, output pixel x takes channel c from sample 9x + 1 + c; the first and
+// last pixels of a row are copied unfiltered.
+
+// Other weights tried:
+//   [0x08 0x4d 0x56 0x4d 0x08] / 256
+//   R: [0.15, 0.25, 0.3,  0.25, 0.15]
+//   G: [0.1,  0.3,  0.6,  0.3,  0.1]   <- stronger center (green)
+//   B: [0.15, 0.25, 0.3,  0.25, 0.15]
+
+// The original floating point filter, kept to check subpixel_row() against.
+template <int N>
+void subpixel_row_reference(const uint8_t* src, uint8_t* dst, int w) {
+    auto filter = [&](float x0, float x1, float x2, float x3, float x4) -> float {
+        return x0 * (1.0 / 9) + x1 * (2.0 / 9) + x2 * (3.0 / 9) + x3 * (2.0 / 9) + x4 * (1.0 / 9);
+    };
+    auto sample = [&](int j) { return src[j / 3 * N + j % 3]; };
+
+    for (int x = 0; x < w; ++x) {
+        for (int c = 0; c < 3; ++c) {
+            if (x == 0 || x == w - 1) {
+                dst[x * 4 + c] = src[x * 3 * N + c];
+                continue;
+            }
+            int j = 9 * x + 1 + c;
+            dst[x * 4 + c] = (int)filter(sample(j - 6), sample(j - 3), sample(j), sample(j + 3), sample(j + 6));
+        }
+        dst[x * 4 + 3] = 255;
+    }
+}
+
+// Fixed-point version of the above. Filtering runs over every byte of the
+// row with 16-bit lanes (sum * 7282 >> 16 is sum / 9, rounded down, for any
+// sum up to 9 * 255), then a shuffle picks each pixel's three samples out
+// of the filtered row. Differs from the reference by at most 1, where
+// floating point rounding lands just below a whole number.
+// Writes only output pixels [first, first + count) of the row, to dst[0...].
+template <int N>
+void subpixel_row(const uint8_t* src, uint8_t* dst, int w, int first, int count) {
+    static_assert(N == 3 || N == 4);
+    int lo = std::max(first, 1), hi = std::min(first + count, w - 1); // filtered pixels
+    dst -= first * 4;
+
+    // filtered bytes for pixels [lo, hi), with room for the shuffles below to
+    // read past the end.
+    thread_local std::vector<uint8_t> filtered;
+    int begin = 3 * N * lo, end = 3 * N * hi;
+    filtered.resize(std::max(end, 0) + 8 * N + 32);
+
+    auto filter = [&](int i) {
+        int sum = src[i - 2 * N] + 2 * src[i - N] + 3 * src[i] + 2 * src[i + N] + src[i + 2 * N];
+        return (uint8_t)(sum * 7282 >> 16);
+    };
+
+    int i = begin;
+#if defined(__AVX2__)
+    const __m256i ninth = _mm256_set1_epi16(7282);
+    auto filter16 = [&](int i) {
+        auto load = [&](int offset) {
+            return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&src[i + offset]));
+        };
+        __m256i outer = _mm256_add_epi16(load(-2 * N), load(2 * N));
+        __m256i inner = _mm256_add_epi16(load(-N), load(N));
+        __m256i center = load(0);
+        __m256i sum = _mm256_add_epi16(_mm256_add_epi16(outer, _mm256_slli_epi16(inner, 1)),
+            _mm256_add_epi16(center, _mm256_slli_epi16(center, 1)));
+        return _mm256_mulhi_epu16(sum, ninth);
+    };
+    for (; i + 32 <= end; i += 32) {
+        __m256i packed = _mm256_packus_epi16(filter16(i), filter16(i + 16));
+        _mm256_storeu_si256((__m256i*)&filtered[i], _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+#elif defined(__SSE2__)
+    const __m128i ninth = _mm_set1_epi16(7282);
+    const __m128i zero = _mm_setzero_si128();
+    auto filter8 = [&](int i) {
+        auto load = [&](int offset) {
+            return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&src[i + offset]), zero);
+        };
+        __m128i outer = _mm_add_epi16(load(-2 * N), load(2 * N));
+        __m128i inner = _mm_add_epi16(load(-N), load(N));
+        __m128i center = load(0);
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(outer, _mm_slli_epi16(inner, 1)),
+            _mm_add_epi16(center, _mm_slli_epi16(center, 1)));
+        return _mm_mulhi_epu16(sum, ninth);
+    };
+    for (; i + 16 <= end; i += 16) {
+        _mm_storeu_si128((__m128i*)&filtered[i], _mm_packus_epi16(filter8(i), filter8(i + 8)));
+    }
+#endif
+    for (; i < end; ++i) {
+        filtered[i] = filter(i);
+    }
+
+    auto copy = [&](int x) {
+        const uint8_t* p = &src[3 * N * x];
+        dst[x * 4 + 0] = p[0], dst[x * 4 + 1] = p[1], dst[x * 4 + 2] = p[2], dst[x * 4 + 3] = 255;
+    };
+    if (first == 0) {
+        copy(0);
+    }
+
+    // pixel x's samples sit at 3Nx + 1, 3Nx + 2 and 3Nx + N.
+    int x = lo;
+#if defined(__SSSE3__)
+    // two pixels per shuffle, 16 per iteration.
+    const __m128i pick = _mm_setr_epi8(
+        0, 1, N - 1, -1, 3 * N, 3 * N + 1, 4 * N - 1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    auto four = [&](int x) {
+        const uint8_t* p = &filtered[3 * N * x + 1];
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), pick);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 6 * N)), pick);
+        _mm_storeu_si128((__m128i*)&dst[x * 4], _mm_or_si128(_mm_unpacklo_epi64(a, b), alpha));
+    };
+    for (; x + 16 <= hi; x += 16) {
+        four(x);
+        four(x + 4);
+        four(x + 8);
+        four(x + 12);
+    }
+    for (; x + 4 <= hi; x += 4) {
+        four(x);
+    }
+#endif
+    for (; x < hi; ++x) {
+        const uint8_t* p = &filtered[3 * N * x];
+        dst[x * 4 + 0] = p[1];
+        dst[x * 4 + 1] = p[2];
+        dst[x * 4 + 2] = p[N];
+        dst[x * 4 + 3] = 255;
+    }
+
+    if (w > 1 && first + count == w) {
+        copy(w - 1);
+    }
+}
+
+template <int N>
+void subpixel_row(const uint8_t* src, uint8_t* dst, int w) {
+    subpixel_row<N>(src, dst, w, 0, w);
+}
+
+template <int N>
+void subpixel_rows(const uint8_t* src, int stride, int w, int h, uint8_t* dst, int dst_stride, int first, int count) {
+    // not worth waking up other threads for a tile.
+#pragma omp parallel for if ((long)count * h > 1 << 18)
+    for (int y = 0; y < h; ++y) {
+        subpixel_row<N>(src + (size_t)y * stride, dst + (size_t)y * dst_stride, w, first, count);
+    }
+}
+
+// `src` is `h` rows of `stride` bytes, each 3w columns of `n` bytes. Output
+// pixels [first, first + count) of each row go to `dst`, `dst_stride` bytes
+// apart, as RGBA.
+void subpixel_filter(const uint8_t* src, int stride, int n, int w, int h,
+    uint8_t* dst, int dst_stride, int first, int count) {
+    switch (n) {
+    case 3:
+        subpixel_rows<3>(src, stride, w, h, dst, dst_stride, first, count);
+        break;
+    case 4:
+        subpixel_rows<4>(src, stride, w, h, dst, dst_stride, first, count);
+        break;
+    default:
+        throw std::runtime_error("subpixel rendering needs an RGB pixmap");
+    }
+}
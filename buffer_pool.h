@@ -0,0 +1,100 @@
+#include "backends/pixel_buffer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#pragma once
+
+// Hands out page-sized PixelBuffers and takes their memory back once the
+// last reference goes, so that turning pages in steady state reuses the
+// memory of pages that dropped out of the caches instead of allocating.
+// Blocks are 64-byte aligned and rows are packed (stride = width * 4), which
+// is what texture uploads and MuPDF's pixmaps expect.
+//
+// At most `limit` bytes are kept idle; anything beyond that is freed.
+class BufferPool {
+public:
+    struct Stats {
+        size_t allocations = 0, reuses = 0;
+        size_t idle_blocks = 0, idle_bytes = 0;
+    };
+
+private:
+    // Shared with every buffer handed out, which may outlive the pool.
+    struct Blocks {
+        std::mutex mutex;
+        std::multimap<size_t, uint8_t*> idle; // by capacity
+        size_t limit;
+        Stats stats;
+
+        ~Blocks() {
+            for (auto& [_, block] : idle) {
+                free(block);
+            }
+        }
+    };
+    std::shared_ptr<Blocks> blocks;
+
+    static constexpr size_t ALIGNMENT = 64;
+
+public:
+    BufferPool(size_t limit)
+        : blocks { std::make_shared<Blocks>() } {
+        blocks->limit = limit;
+    }
+
+    std::shared_ptr<PixelBuffer> acquire(sf::Vector2u size) {
+        size_t stride = (size_t)size.x * 4;
+        size_t bytes = std::max<size_t>(stride * size.y, 1);
+        size_t capacity = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+        // reuse the smallest idle block that fits, unless it's more than
+        // half as big again as needed, wasting over a third of it (a tile
+        // shouldn't take a whole page's block).
+        uint8_t* block = nullptr;
+        {
+            std::lock_guard lock(blocks->mutex);
+            auto it = blocks->idle.lower_bound(capacity);
+            if (it != blocks->idle.end() && it->first <= capacity * 3 / 2) {
+                capacity = it->first;
+                block = it->second;
+                blocks->stats.idle_bytes -= capacity;
+                blocks->idle.erase(it);
+                blocks->stats.reuses += 1;
+            } else {
+                blocks->stats.allocations += 1;
+            }
+        }
+        if (!block) {
+            block = (uint8_t*)aligned_alloc(ALIGNMENT, capacity);
+            if (!block) {
+                throw std::bad_alloc();
+            }
+        }
+
+        return std::shared_ptr<PixelBuffer>(new PixelBuffer { size, stride, block },
+            [blocks = blocks, capacity](PixelBuffer* buffer) {
+                {
+                    std::lock_guard lock(blocks->mutex);
+                    if (blocks->stats.idle_bytes + capacity <= blocks->limit) {
+                        blocks->idle.emplace(capacity, buffer->pixels);
+                        blocks->stats.idle_bytes += capacity;
+                        buffer->pixels = nullptr;
+                    }
+                }
+                free(buffer->pixels);
+                delete buffer;
+            });
+    }
+
+    Stats stats() {
+        std::lock_guard lock(blocks->mutex);
+        Stats stats = blocks->stats;
+        stats.idle_blocks = blocks->idle.size();
+        return stats;
+    }
+};
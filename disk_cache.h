@@ -0,0 +1,247 @@
+#include "buffer_pool.h"
+#include "page_cache.h"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#pragma once
+
+// Identifies a document by its contents rather than its path. Hashing all
+// of a 500 MB scan on every open would cost more than the cache saves, so
+// this covers the file size and its first and last megabyte (FNV-1a).
+uint64_t document_fingerprint(const char* filename) {
+    uint64_t hash = 0xcbf29ce484222325;
+    auto mix = [&](const char* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3;
+        }
+    };
+
+    std::ifstream in(filename, std::ios::binary);
+    in.seekg(0, std::ios::end);
+    uint64_t size = in.tellg();
+    mix((const char*)&size, sizeof(size));
+
+    constexpr size_t chunk = 1 << 20;
+    std::vector<char> buffer(chunk);
+    for (uint64_t offset : { (uint64_t)0, size > chunk ? size - chunk : 0 }) {
+        in.seekg(offset);
+        in.read(buffer.data(), chunk);
+        mix(buffer.data(), in.gcount());
+        in.clear();
+    }
+    return hash;
+}
+
+// Rendered pages kept on disk under $XDG_CACHE_HOME/pdfviewer, so reopening
+// a document shows the pages viewed last time without rendering them.
+//
+// Each page is one file of raw RGBA pixels behind a small header, read back
+// through mmap straight into a pooled buffer. Files are written under a
+// temporary name and renamed into place, and a flock on the cache's lock
+// file keeps several viewers from reading a file while another one trims
+// the cache.
+class DiskCache {
+private:
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t width, height;
+    };
+    static constexpr char MAGIC[4] = { 'P', 'D', 'V', 'C' };
+    static constexpr uint32_t VERSION = 1;
+
+    std::filesystem::path root, dir;
+    uint64_t id;
+    size_t budget;
+    bool enabled = true;
+    std::atomic<size_t> written_since_trim = 0;
+
+    class Lock {
+        int fd;
+
+    public:
+        Lock(const std::filesystem::path& path, int operation) {
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd >= 0) {
+                flock(fd, operation);
+            }
+        }
+        ~Lock() {
+            if (fd >= 0) {
+                close(fd); // releases the lock
+            }
+        }
+    };
+
+    static std::filesystem::path cache_root() {
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        if (xdg && *xdg) {
+            return std::filesystem::path(xdg) / "pdfviewer";
+        }
+        const char* home = getenv("HOME");
+        return std::filesystem::path(home ? home : "/tmp") / ".cache" / "pdfviewer";
+    }
+
+    std::filesystem::path page_path(int page, float zoom, bool subpixel) {
+        return dir / ("p" + std::to_string(page) + "_z" + std::to_string(quantize_zoom(zoom, true)) + (subpixel ? "_s" : "_n") + ".raw");
+    }
+
+    // Deletes the least recently used pages, across all documents, until
+    // the cache fits in its budget.
+    void trim() {
+        Lock lock(root / "lock", LOCK_EX);
+
+        struct File {
+            std::filesystem::path path;
+            std::filesystem::file_time_type time;
+            uintmax_t size;
+        };
+        std::vector<File> files;
+        uintmax_t total = 0;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(root, ec)) {
+            if (entry.is_regular_file(ec) && entry.path().extension() == ".raw") {
+                files.push_back({ entry.path(), entry.last_write_time(ec), entry.file_size(ec) });
+                total += files.back().size;
+            }
+        }
+
+        std::sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.time < b.time; });
+        for (const File& file : files) {
+            if (total <= budget) {
+                break;
+            }
+            if (std::filesystem::remove(file.path, ec)) {
+                total -= file.size;
+            }
+        }
+    }
+
+public:
+    DiskCache(const char* filename, size_t budget = (size_t)2 << 30)
+        : budget { budget } {
+        id = document_fingerprint(filename);
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)id);
+        root = cache_root();
+        dir = root / name;
+
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) {
+            std::cerr << "disk cache disabled: " << ec.message() << std::endl;
+            enabled = false;
+        }
+    }
+
+    uint64_t fingerprint() const {
+        return id;
+    }
+
+    // Where to keep other files for this document, such as thumbnails, or
+    // an empty path if the cache is disabled. trim() leaves them alone.
+    std::filesystem::path file(const std::string& name) const {
+        return enabled ? dir / name : std::filesystem::path();
+    }
+
+    std::shared_ptr<const PixelBuffer> load(int page, float zoom, bool subpixel, BufferPool& buffers) {
+        if (!enabled) {
+            return nullptr;
+        }
+
+        std::filesystem::path path = page_path(page, zoom, subpixel);
+        int fd;
+        {
+            Lock lock(root / "lock", LOCK_SH);
+            fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= sizeof(Header)) {
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+
+        std::shared_ptr<PixelBuffer> image;
+        const Header* header = (const Header*)data;
+        if (std::equal(MAGIC, MAGIC + 4, header->magic) && header->version == VERSION
+            && st.st_size == sizeof(Header) + (size_t)header->width * header->height * 4) {
+            image = buffers.acquire({ header->width, header->height });
+            const uint8_t* pixels = (const uint8_t*)(header + 1);
+            for (unsigned int y = 0; y < header->height; ++y) {
+                memcpy(image->row(y), pixels + (size_t)y * header->width * 4, header->width * 4);
+            }
+        }
+        munmap(data, st.st_size);
+
+        // mark it as recently used for trim().
+        std::error_code ec;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+        return image;
+    }
+
+    // Blocks on file I/O, so it's best run on a background thread.
+    void store(int page, float zoom, bool subpixel, const PixelBuffer& image) {
+        if (!enabled) {
+            return;
+        }
+
+        std::filesystem::path path = page_path(page, zoom, subpixel);
+        std::filesystem::path tmp = path;
+        tmp += ".tmp" + std::to_string(getpid()) + "_" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+        auto [w, h] = image.size;
+        Header header = { { MAGIC[0], MAGIC[1], MAGIC[2], MAGIC[3] }, VERSION, w, h };
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            out.write((const char*)&header, sizeof(header));
+            for (unsigned int y = 0; y < h; ++y) {
+                out.write((const char*)image.row(y), (size_t)w * 4);
+            }
+            if (!out) {
+                std::error_code ec;
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+        {
+            Lock lock(root / "lock", LOCK_EX);
+            std::error_code ec;
+            std::filesystem::rename(tmp, path, ec);
+            if (ec) {
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+
+        // scanning the whole cache is slow, so only trim once in a while.
+        written_since_trim += sizeof(header) + (size_t)w * h * 4;
+        if (written_since_trim > budget / 16) {
+            written_since_trim = 0;
+            trim();
+        }
+    }
+};
@@ -10,7 +10,19 @@
 #include "backends/cbz.h"
 #include "backends/pdf.h"
 #include "backends/djvu.h"
+#include "buffer_pool.h"
+#include "disk_cache.h"
 #include "json.hpp"
+#include "page_cache.h"
+#include "page_renderer.h"
+#include "prefetcher.h"
+#include "render_pool.h"
+#include "scroll_layout.h"
+#include "search.h"
+#include "text_index.h"
+#include "texture_pool.h"
+#include "thumbnails.h"
+#include "tile_cache.h"
 
 using json = nlohmann::json;
 
@@ -19,6 +31,7 @@ struct Settings {
     int current_page = 0;
     float zoom = 1.0;
     std::map<char, int> bookmarks;
+    bool continuous = false;
 };
 
 // Remember settings for each document/path that is opened.
@@ -32,12 +45,20 @@ public:
         data = json::parse(std::ifstream(METADATA_FILE));
     }
 
+    // Where a document's text index goes, next to the metadata.
+    std::filesystem::path text_index(uint64_t fingerprint) {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)fingerprint);
+        return std::filesystem::path(METADATA_FILE).replace_extension("index") / name;
+    }
+
     void save(const char* filename, Settings setting) {
         data[filename] = {
             { "dual_mode", setting.dual_mode },
             { "current_page", setting.current_page },
             { "zoom", setting.zoom },
             { "bookmarks", setting.bookmarks },
+            { "continuous", setting.continuous },
         };
         std::ofstream out(METADATA_FILE);
         out << std::setw(4) << data << std::endl;
@@ -50,6 +71,7 @@ public:
                   data[filename]["current_page"],
                   data[filename]["zoom"],
                   data[filename]["bookmarks"],
+                  data[filename].value("continuous", false),
               }
             : Settings {};
     }
@@ -65,17 +87,146 @@ private:
     std::vector<TOCEntry> toc;
 
     Metadata metadata;
+    RenderPool pool;
+    BufferPool buffers { 128 << 20 };
+    PageCache page_cache { 256 << 20 };
+    DiskCache* disk_cache;
+    Prefetcher* prefetcher;
 
     sf::RenderWindow window;
-    sf::Texture page_texture;
-    sf::Sprite* page_sprite;
+    TexturePool textures { 4 };
+
+    // The pages on screen, one texture each, side by side in dual mode.
+    struct ShownPage {
+        int page;
+        std::shared_ptr<sf::Texture> texture;
+        sf::Sprite sprite;
+    };
+    std::vector<ShownPage> shown_pages;
 
     bool subpixel = true;
-    bool is_current_page_large = false;
+
+    static constexpr float MAX_ZOOM = 32;
+    static constexpr float SCROLL_STEP = 60; // pixels per wheel notch or arrow key
+
+    // Past TILE_ZOOM a whole-page bitmap gets too big, so the page is drawn
+    // from TILE_SIZE square tiles instead and only the tiles on screen (plus
+    // a few more in the direction of panning) are rendered.
+    static constexpr float TILE_ZOOM = 2;
+    static constexpr int TILE_SIZE = 256;
+
+    bool tiled = false;
+    int tiled_page = -1;
+    float tiled_zoom = 1; // what the tile layout is for; see drawTiles()
+    sf::Vector2u tiled_page_size;
+    sf::Vector2f tiled_origin; // window position of the page's top-left corner
+    sf::Vector2f pan_direction;
+    TileCache tiles { 512 };
+    struct PendingTile {
+        std::future<std::shared_ptr<PixelBuffer>> image;
+        std::shared_ptr<RenderToken> token;
+    };
+    std::map<TileKey, PendingTile> pending_tiles;
+
+    // Continuous mode shows the pages stacked in one scrolling column. Only
+    // the pages within a screen of the window are rendered and kept as
+    // textures; the rest are just rectangles in the layout, so memory goes
+    // with the size of the window rather than of the document.
+    ScrollLayout layout { 0, {} };
+    std::future<std::vector<sf::Vector2f>> measuring; // real page sizes, for the layout
+    std::shared_ptr<RenderToken> measure_token;
+    float scroll_y = 0; // top of the window, in pixels down the column at the current zoom
+    float scroll_x = 0; // how far the column is panned right of centre
+    float scroll_zoom = 1; // the zoom pages are rendered at once input settles
+    struct ScrollPage {
+        std::shared_ptr<sf::Texture> texture;
+        sf::Vector2u image_size;
+        float zoom;
+        bool subpixel;
+    };
+    std::map<int, ScrollPage> scroll_pages;
+    struct PendingPage {
+        std::future<std::shared_ptr<const PixelBuffer>> image;
+        std::shared_ptr<RenderToken> token;
+        float zoom;
+        bool subpixel;
+    };
+    std::map<int, PendingPage> pending_pages;
+
+    // Matches stream in from the search, nearest to where it started first;
+    // the view goes to the first one to arrive.
+    TextIndex* text_index;
+    Search* search;
+    char search_text[256] = "";
+    bool focus_search = false;
+    std::map<int, std::vector<SearchMatch>> search_matches; // by page
+    size_t search_match_count = 0;
+    std::pair<int, int> current_match = { -1, 0 }; // page, and index within it
+
+    // The grid overview of thumbnails, over whatever mode the pages are in.
+    // Thumbnails are made the first time it's opened, which needs the
+    // window's GL context.
+    static constexpr float GRID_GAP = 16;
+    Thumbnails* thumbnails = nullptr;
+    bool grid = false;
+    float grid_scroll = 0;
+
+    // Rendering waits for the start of the next frame, so a burst of key
+    // repeats or wheel events only renders the page it ends on. The render
+    // thread drops anything it's working on once a newer request arrives.
+    //
+    // Zooming and resizing wait longer, until no more such input has come
+    // for DEBOUNCE, and meanwhile the pages on screen are scaled on the GPU.
+    // A wheel flick then renders once, at the zoom it ends on.
+    static constexpr auto DEBOUNCE = std::chrono::milliseconds(150);
+    PageRenderer* renderer;
+    bool render_pending = false;
+    // Spreads to step from steps_from in dual mode, resolved by the renderer
+    // since it depends on which pages are wide. A burst of page turns
+    // within one render adds up here instead of moving current_page.
+    int pending_steps = 0;
+    int steps_from = 0;
+    std::chrono::steady_clock::time_point render_at;
+    bool zooming = false; // the pending render is for a zoom gesture
+    uint64_t latest_request = 0;
+    uint64_t shown_request = 0; // the request shown_pages show a stage of
+
+    // What shown_pages hold, so the first can stand in, scaled up, for tiles
+    // that haven't been rendered yet.
+    int sprite_page = -1;
+    float sprite_shown_zoom = 1; // the zoom shown_pages are scaled to look like
+
+    // Frames are only drawn when something changed: input, a resize, or a
+    // finished render. ImGui needs a few frames after input to settle (hover
+    // states, opening menus), hence a count rather than a flag.
+    bool redraw_on_demand = true;
+    int frames_to_draw = 0;
+    size_t frames_drawn = 0;
+
+    void requestRedraw(int frames = 1) {
+        frames_to_draw = std::max(frames_to_draw, frames);
+    }
+
+    // Whether some background work may still want to update the window.
+    bool busy() {
+        return render_pending || renderer->busy() || prefetcher->busy() || !pending_tiles.empty()
+            || !pending_pages.empty() || measuring.valid() || (grid && thumbnails->busy()) || search->busy();
+    }
 
     void fitPage() {
+        if (settings.continuous) {
+            // fit the width of the widest page.
+            float f = window.getSize().x / (layout.width() * settings.zoom);
+            settings.zoom *= f;
+            scroll_y *= f;
+            scroll_x = 0;
+            return;
+        }
+        if (!tiled && shown_pages.empty()) {
+            return;
+        }
         auto [ww, wh] = window.getSize();
-        auto [pw, ph] = page_texture.getSize();
+        auto [pw, ph] = tiled ? tiled_page_size : sf::Vector2u(spreadSize());
 
         if ((float)pw / ph < (float)ww / wh) {
             settings.zoom = (float)wh / ph * settings.zoom;
@@ -84,72 +235,704 @@ private:
         }
     }
 
-    // Only takes 4-8 ms, surprisingly. Thought using setPixel(), getPixel()
-    // might be slow.
-    sf::Image concatImagesHorizontally(const sf::Image& image1, const sf::Image& image2) {
-        auto [w1, h1] = image1.getSize();
-        auto [w2, h2] = image2.getSize();
+    void renderPage() {
+        if (settings.continuous && settings.current_page != scrolledPage()) {
+            scroll_y = layout.top(settings.current_page) * settings.zoom;
+            requestRedraw();
+        }
+
+        render_pending = true;
+        render_at = std::chrono::steady_clock::now();
+        zooming = false;
+    }
+
+    // Like renderPage(), but only once input has settled.
+    void renderPageLater(bool zoom_gesture) {
+        if (!render_pending) {
+            zooming = zoom_gesture;
+        }
+        render_pending = true;
+        render_at = std::chrono::steady_clock::now() + DEBOUNCE;
+    }
 
-        sf::Image newImage({ w1 + w2, std::max(h1, h2) }, sf::Color::Transparent);
+    // Zooms one step about the centre of the window, scaling what's on
+    // screen until the render at the new zoom comes in.
+    void zoomStep(bool in) {
+        float old_zoom = settings.zoom;
+        if (in) {
+            zoomIn();
+        } else {
+            zoomOut();
+        }
+        if (settings.zoom == old_zoom) {
+            return;
+        }
 
-        for (unsigned int y = 0; y < h1; ++y) {
-            for (unsigned int x = 0; x < w1; ++x) {
-                newImage.setPixel({ x, y }, image1.getPixel({ x, y }));
+        if (settings.continuous) {
+            // keep whatever is at the centre of the window there.
+            float f = settings.zoom / old_zoom;
+            float half = window.getSize().y / 2.0f;
+            scroll_y = (scroll_y + half) * f - half;
+            scroll_x *= f;
+        } else if (!tiled) {
+            auto [wx, wy] = window.getSize();
+            sf::Vector2f center = { wx / 2.0f, wy / 2.0f };
+            float f = settings.zoom / sprite_shown_zoom;
+            for (ShownPage& page : shown_pages) {
+                page.sprite.setPosition(center - (center - page.sprite.getPosition()) * f);
+                page.sprite.setScale(page.sprite.getScale() * f);
             }
+            sprite_shown_zoom = settings.zoom;
+        }
+        renderPageLater(true);
+    }
+
+    void startRender() {
+        if (settings.continuous) {
+            // no page bitmaps past TILE_ZOOM here; pages beyond it are stretched.
+            scroll_zoom = std::min(settings.zoom, TILE_ZOOM);
+            render_pending = false;
+            prefetcher->navigated(settings.current_page, settings.zoom);
+            return;
+        }
+
+        bool tiled_request = settings.zoom > TILE_ZOOM;
+        if (steps_from != settings.current_page) {
+            pending_steps = 0; // jumped somewhere else since
+        }
+        PageRequest request = {
+            latest_request + 1,
+            settings.current_page,
+            tiled_request ? 0 : pending_steps,
+            settings.dual_mode && !tiled_request,
+            settings.zoom,
+            subpixel,
+            tiled_request,
+        };
+        if (!renderer->request(std::move(request))) {
+            return; // try again next frame
+        }
+        latest_request += 1;
+        render_pending = false;
+        prefetcher->navigated(settings.current_page, settings.zoom);
+    }
+
+    sf::Vector2f spreadSize() {
+        sf::Vector2f size;
+        for (const ShownPage& page : shown_pages) {
+            sf::Vector2f page_size = page.sprite.getGlobalBounds().size;
+            size = { size.x + page_size.x, std::max(size.y, page_size.y) };
+        }
+        return size;
+    }
+
+    // Uploads each page of `result` into a texture from the pool and lays
+    // them out left to right from `origin`, stretched to their shown sizes.
+    // The textures being replaced go back to the pool, so page turns
+    // alternate between textures and an upload never writes to one still on
+    // screen.
+    void showSpread(const PageResult& result, sf::Vector2f origin) {
+        std::vector<ShownPage> pages;
+        float x = origin.x;
+        for (int i = 0; i < result.halves.size(); ++i) {
+            const PixelBuffer& image = *result.halves[i];
+            sf::Vector2u shown_size = result.shown_sizes[i];
+            auto texture = textures.acquire(image.size);
+            textures.upload(*texture, image);
+            texture->setSmooth(image.size != shown_size);
+
+            sf::Sprite sprite(*texture, sf::IntRect({ 0, 0 }, sf::Vector2i(image.size)));
+            sprite.setScale({ (float)shown_size.x / image.size.x, (float)shown_size.y / image.size.y });
+            sprite.setPosition({ x, origin.y });
+            x += shown_size.x;
+            pages.push_back({ result.spread[i], std::move(texture), std::move(sprite) });
         }
-        for (unsigned int y = 0; y < h2; ++y) {
-            for (unsigned int x = 0; x < w2; ++x) {
-                newImage.setPixel({ w1 + x, y }, image2.getPixel({ x, y }));
+        shown_pages = std::move(pages);
+        sprite_page = settings.current_page;
+        sprite_shown_zoom = settings.zoom;
+        tiled = false;
+    }
+
+    // Takes finished work from the render thread. Results for anything but
+    // the latest request are stale and dropped.
+    void updateRender() {
+        PageResult result;
+        while (renderer->poll(result)) {
+            if (result.id != latest_request || render_pending || settings.continuous) {
+                continue;
+            }
+
+            requestRedraw();
+            bool first = result.id != shown_request;
+            bool same_pages = !tiled && !shown_pages.empty() && sprite_page == result.page;
+            if (zooming && same_pages && result.stage == PageResult::Preview) {
+                continue; // the old render, scaled, looks better than a preview
+            }
+            settings.current_page = result.page;
+            pending_steps = 0; // the latest request had them all
+            if (result.stage == PageResult::Tiled) {
+                renderTiledPage(result.shown_size);
+            } else if (same_pages && (!first || zooming)) {
+                // replace the preview or the scaled pages, keeping wherever
+                // they've been panned to.
+                showSpread(result, shown_pages[0].sprite.getPosition());
+            } else {
+                auto [wx, wy] = window.getSize();
+                sf::Vector2f centred = {
+                    (float)round(wx / 2.0 - result.shown_size.x / 2.0),
+                    (float)round(wy / 2.0 - result.shown_size.y / 2.0),
+                };
+                showSpread(result, centred);
+            }
+            shown_request = result.id;
+
+            const char* stage = result.stage == PageResult::Preview ? "preview"
+                : result.stage == PageResult::Tiled                ? "lay out tiles"
+                : result.rendered                                   ? "render"
+                                                                    : "show cached page";
+            std::cout << (int)(result.seconds * 1000) << "ms to " << stage << std::endl;
+            if (result.rendered) {
+                prefetcher->rendered(result.seconds);
+            }
+            if (first && result.stage != PageResult::Tiled) {
+                prefetcher->schedule(settings.current_page, result.spread.size(), settings.zoom, subpixel, TILE_ZOOM);
             }
         }
-        return newImage;
     }
 
-    void renderPage(bool handle_special_case = false) {
-        using std::chrono::duration_cast;
-        using std::chrono::high_resolution_clock;
-        using std::chrono::milliseconds;
+    void renderTiledPage(sf::Vector2u size) {
+        auto [wx, wy] = window.getSize();
+        sf::Vector2f center = { wx / 2.0f, wy / 2.0f };
 
-        if (settings.current_page == 0) {
-            handle_special_case = false;
+        // keep whatever is at the centre of the window there when zooming,
+        // otherwise centre the new page.
+        if (tiled && tiled_page == settings.current_page) {
+            float f = (float)size.x / tiled_page_size.x;
+            tiled_origin = center - (center - tiled_origin) * f;
+        } else if (!tiled && !shown_pages.empty() && sprite_page == settings.current_page) {
+            float f = settings.zoom / sprite_shown_zoom;
+            tiled_origin = center - (center - shown_pages[0].sprite.getPosition()) * f;
+        } else {
+            tiled_origin = { (float)round(center.x - size.x / 2.0), (float)round(center.y - size.y / 2.0) };
         }
-        if (handle_special_case) {
-            if (settings.current_page > 0) {
-                settings.current_page -= 1;
+
+        tiled = true;
+        tiled_page = settings.current_page;
+        tiled_zoom = settings.zoom;
+        tiled_page_size = size;
+    }
+
+    TileKey tileKey(int x, int y) {
+        return { tiled_page, tiled_zoom, subpixel, x, y };
+    }
+
+    sf::IntRect tileRect(int x, int y) {
+        int w = std::min(TILE_SIZE, (int)tiled_page_size.x - x * TILE_SIZE);
+        int h = std::min(TILE_SIZE, (int)tiled_page_size.y - y * TILE_SIZE);
+        return sf::IntRect({ x * TILE_SIZE, y * TILE_SIZE }, { w, h });
+    }
+
+    // Range of tile columns/rows [lo, hi) that intersect the window.
+    std::pair<sf::Vector2i, sf::Vector2i> visibleTiles() {
+        auto [wx, wy] = window.getSize();
+        int columns = (tiled_page_size.x + TILE_SIZE - 1) / TILE_SIZE;
+        int rows = (tiled_page_size.y + TILE_SIZE - 1) / TILE_SIZE;
+        sf::Vector2i lo = {
+            std::clamp((int)floor(-tiled_origin.x / TILE_SIZE), 0, columns),
+            std::clamp((int)floor(-tiled_origin.y / TILE_SIZE), 0, rows),
+        };
+        sf::Vector2i hi = {
+            std::clamp((int)ceil((wx - tiled_origin.x) / TILE_SIZE), 0, columns),
+            std::clamp((int)ceil((wy - tiled_origin.y) / TILE_SIZE), 0, rows),
+        };
+        return { lo, hi };
+    }
+
+    // Collects finished tiles and queues the ones that are missing, visible
+    // tiles first and then a band beyond the edge we're panning towards.
+    void updateTiles() {
+        for (auto it = pending_tiles.begin(); it != pending_tiles.end();) {
+            const TileKey& key = it->first;
+            if (key.page != tiled_page || key.zoom != tiled_zoom || key.subpixel != subpixel) {
+                it->second.token->cancel();
+                it = pending_tiles.erase(it);
+                continue;
+            }
+            if (it->second.image.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++it;
+                continue;
             }
+            try {
+                tiles.insert(key, *it->second.image.get());
+                requestRedraw();
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            it = pending_tiles.erase(it);
         }
 
-        auto t1 = high_resolution_clock::now();
+        auto [lo, hi] = visibleTiles();
+        auto request = [&](int x, int y) {
+            TileKey key = tileKey(x, y);
+            if (pending_tiles.size() >= pool.size() * 2 || tiles.contains(key) || pending_tiles.contains(key)) {
+                return;
+            }
+            auto token = std::make_shared<RenderToken>();
+            pending_tiles[key] = {
+                pool.submit([this, key, region = tileRect(x, y), token] {
+                    auto image = buffers.acquire(sf::Vector2u(region.size));
+                    backend->render_into(key.page, key.zoom, key.subpixel, region, *image, token.get());
+                    return image;
+                }),
+                token,
+            };
+        };
+        for (int y = lo.y; y < hi.y; ++y) {
+            for (int x = lo.x; x < hi.x; ++x) {
+                request(x, y);
+            }
+        }
 
-        sf::Image page = backend->render_page(settings.current_page, settings.zoom, subpixel);
-        auto [w, h] = page.getSize();
-        is_current_page_large = w > h;
-        if (handle_special_case && !is_current_page_large) {
-            if (settings.current_page > 0) {
-                settings.current_page -= 1;
+        int columns = (tiled_page_size.x + TILE_SIZE - 1) / TILE_SIZE;
+        int rows = (tiled_page_size.y + TILE_SIZE - 1) / TILE_SIZE;
+        if (pan_direction.x != 0) {
+            int x = pan_direction.x < 0 ? hi.x : lo.x - 1;
+            for (int y = lo.y; 0 <= x && x < columns && y < hi.y; ++y) {
+                request(x, y);
+            }
+        }
+        if (pan_direction.y != 0) {
+            int y = pan_direction.y < 0 ? hi.y : lo.y - 1;
+            for (int x = lo.x; 0 <= y && y < rows && x < hi.x; ++x) {
+                request(x, y);
+            }
+        }
+    }
+
+    // Until the layout for a new zoom comes in, the tiles are scaled about
+    // the centre of the window to look like it.
+    void drawTiles() {
+        auto [wx, wy] = window.getSize();
+        sf::Vector2f center = { wx / 2.0f, wy / 2.0f };
+        float scale = settings.zoom / tiled_zoom;
+        sf::Vector2f origin = center - (center - tiled_origin) * scale;
+
+        if (sprite_page == tiled_page && !shown_pages.empty()) {
+            float f = settings.zoom / sprite_shown_zoom;
+            sf::Sprite backdrop = shown_pages[0].sprite;
+            backdrop.setScale(backdrop.getScale() * f);
+            backdrop.setPosition(origin);
+            window.draw(backdrop);
+        }
+
+        auto [lo, hi] = visibleTiles();
+        for (int y = lo.y; y < hi.y; ++y) {
+            for (int x = lo.x; x < hi.x; ++x) {
+                if (const sf::Texture* texture = tiles.find(tileKey(x, y))) {
+                    sf::Sprite tile(*texture);
+                    tile.setPosition(origin + sf::Vector2f(x * TILE_SIZE, y * TILE_SIZE) * scale);
+                    tile.setScale({ scale, scale });
+                    window.draw(tile);
+                }
+            }
+        }
+        drawHighlights(tiled_page, origin, settings.zoom);
+    }
+
+    void setContinuous(bool continuous) {
+        settings.continuous = continuous;
+        for (auto& [page, pending] : pending_pages) {
+            pending.token->cancel();
+        }
+        pending_pages.clear();
+        scroll_pages.clear();
+        if (!continuous) {
+            renderPage();
+            return;
+        }
+
+        for (auto& [key, pending] : pending_tiles) {
+            pending.token->cancel();
+        }
+        pending_tiles.clear();
+        shown_pages.clear();
+        tiled = false;
+        sprite_page = -1;
+        measurePages();
+        scroll_x = 0;
+        scroll_y = layout.top(settings.current_page) * settings.zoom;
+        renderPage();
+    }
+
+    // Lays the column out from the first page's size and measures the rest
+    // in the background, which would take a while on the UI thread for a
+    // long document. Only done once continuous mode is first used.
+    void measurePages() {
+        if (measure_token) {
+            return;
+        }
+        layout = ScrollLayout(page_count, page_count > 0 ? backend->measure_page(0) : sf::Vector2f());
+        measure_token = std::make_shared<RenderToken>();
+        measuring = pool.submit([this, token = measure_token] {
+            std::vector<sf::Vector2f> sizes;
+            for (int i = 0; i < page_count; ++i) {
+                RenderToken::check(token.get());
+                sizes.push_back(backend->measure_page(i));
             }
+            return sizes;
+        },
+            RenderPool::Priority::Background);
+    }
+
+    // The page at the top of the window.
+    int scrolledPage() {
+        return layout.page_at(scroll_y / settings.zoom);
+    }
+
+    void clampScroll() {
+        float bottom = layout.height() * settings.zoom - window.getSize().y;
+        scroll_y = std::clamp(scroll_y, 0.0f, std::max(bottom, 0.0f));
+    }
+
+    // Picks up the page sizes once they're measured.
+    void updateLayout() {
+        if (!measuring.valid() || measuring.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
         }
-        if (!is_current_page_large && settings.dual_mode && settings.current_page + 1 < page_count) {
-            std::cout << settings.current_page << " " << (handle_special_case ? 0 : 1) << std::endl;
-            auto second_page = backend->render_page(settings.current_page + (handle_special_case ? 0 : 1), settings.zoom, subpixel);
-            if (handle_special_case) {
-                std::swap(page, second_page);
+        try {
+            // keep the page at the top of the window where it is.
+            int page = scrolledPage();
+            float offset = scroll_y - layout.top(page) * settings.zoom;
+            layout.set_sizes(measuring.get());
+            scroll_y = layout.top(page) * settings.zoom + offset;
+            requestRedraw();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+    }
+
+    // Collects finished pages and queues renders of the ones missing or at
+    // a stale zoom: first those in the window, then those within a window's
+    // height of it. Pages further away are dropped, their textures going
+    // back to the pool for the pages scrolling in.
+    void updateScroll() {
+        clampScroll();
+        settings.current_page = scrolledPage();
+
+        float wy = window.getSize().y;
+        auto [lo, hi] = layout.pages_between(scroll_y / settings.zoom, (scroll_y + wy) / settings.zoom);
+        auto [near_lo, near_hi] = layout.pages_between((scroll_y - wy) / settings.zoom, (scroll_y + 2 * wy) / settings.zoom);
+
+        std::erase_if(scroll_pages, [&](const auto& entry) { return entry.first < near_lo || entry.first >= near_hi; });
+        for (auto it = pending_pages.begin(); it != pending_pages.end();) {
+            int page = it->first;
+            PendingPage& pending = it->second;
+            if (page < near_lo || page >= near_hi || pending.zoom != scroll_zoom || pending.subpixel != subpixel) {
+                pending.token->cancel();
+                it = pending_pages.erase(it);
+                continue;
+            }
+            if (pending.image.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++it;
+                continue;
             }
-            page = concatImagesHorizontally(page, second_page);
+            try {
+                auto image = pending.image.get();
+                auto texture = textures.acquire(image->size);
+                textures.upload(*texture, *image);
+                texture->setSmooth(true);
+                scroll_pages[page] = { std::move(texture), image->size, pending.zoom, pending.subpixel };
+                requestRedraw();
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            it = pending_pages.erase(it);
         }
 
-        page_texture = sf::Texture(page);
-        page_sprite = new sf::Sprite(page_texture);
+        auto request = [&](int page, RenderPool::Priority priority) {
+            if (pending_pages.size() >= pool.size() || pending_pages.contains(page)) {
+                return;
+            }
+            if (auto it = scroll_pages.find(page); it != scroll_pages.end()
+                && it->second.zoom == scroll_zoom && it->second.subpixel == subpixel) {
+                return;
+            }
+            auto token = std::make_shared<RenderToken>();
+            pending_pages[page] = {
+                pool.submit([this, page, zoom = scroll_zoom, subpixel = subpixel, token]() -> std::shared_ptr<const PixelBuffer> {
+                    auto cached = page_cache.find(backend, page, zoom, subpixel);
+                    if (!cached && (cached = disk_cache->load(page, zoom, subpixel, buffers))) {
+                        page_cache.insert(backend, page, zoom, subpixel, cached);
+                    }
+                    if (cached) {
+                        return cached;
+                    }
+                    auto image = buffers.acquire(backend->page_size(page, zoom));
+                    backend->render_into(page, zoom, subpixel, sf::IntRect({ 0, 0 }, sf::Vector2i(image->size)), *image, token.get());
+                    page_cache.insert(backend, page, zoom, subpixel, image);
+                    return image;
+                },
+                    priority),
+                token,
+                scroll_zoom,
+                subpixel,
+            };
+        };
+        for (int page = lo; page < hi; ++page) {
+            request(page, RenderPool::Priority::Foreground);
+        }
+        for (int i = 0; hi + i < near_hi || lo - 1 - i >= near_lo; ++i) {
+            if (hi + i < near_hi) {
+                request(hi + i, RenderPool::Priority::Background);
+            }
+            if (lo - 1 - i >= near_lo) {
+                request(lo - 1 - i, RenderPool::Priority::Background);
+            }
+        }
+    }
 
-        auto [tx, ty] = page_texture.getSize();
+    // Pages are stretched to their size at the current zoom, so zooming
+    // shows the old renders scaled until the new ones come in; pages not
+    // rendered yet are drawn as grey rectangles.
+    void drawScroll() {
         auto [wx, wy] = window.getSize();
-        page_sprite->setPosition({
-            (float)round(wx / 2.0 - tx / 2.0),
-            (float)round(wy / 2.0 - ty / 2.0),
-        });
+        auto [lo, hi] = layout.pages_between(scroll_y / settings.zoom, (scroll_y + wy) / settings.zoom);
+        for (int page = lo; page < hi; ++page) {
+            sf::Vector2f size = layout.size(page) * settings.zoom;
+            sf::Vector2f position = {
+                (float)round((wx - size.x) / 2 + scroll_x),
+                (float)round(layout.top(page) * settings.zoom - scroll_y),
+            };
+            if (auto it = scroll_pages.find(page); it != scroll_pages.end()) {
+                sf::Vector2u image_size = it->second.image_size;
+                sf::Sprite sprite(*it->second.texture, sf::IntRect({ 0, 0 }, sf::Vector2i(image_size)));
+                sprite.setScale({ size.x / image_size.x, size.y / image_size.y });
+                sprite.setPosition(position);
+                window.draw(sprite);
+            } else {
+                sf::RectangleShape placeholder(size);
+                placeholder.setFillColor(sf::Color(48, 48, 48));
+                placeholder.setPosition(position);
+                window.draw(placeholder);
+            }
+            drawHighlights(page, position, settings.zoom);
+        }
+    }
+
+    void setGrid(bool open) {
+        grid = open;
+        if (!grid) {
+            return;
+        }
+        if (!thumbnails) {
+            thumbnails = new Thumbnails(backend, pool, disk_cache->file("thumbnails"));
+        }
+        // start with the current page in the middle of the window.
+        auto [columns, pitch, left] = gridLayout();
+        grid_scroll = (settings.current_page / columns + 0.5f) * pitch.y - window.getSize().y / 2.0f;
+    }
+
+    struct GridLayout {
+        int columns;
+        sf::Vector2f pitch; // distance between neighbouring cells
+        float left; // x of the first column
+    };
+
+    GridLayout gridLayout() {
+        sf::Vector2f pitch = { Thumbnails::WIDTH + GRID_GAP, Thumbnails::HEIGHT + GRID_GAP };
+        int columns = std::max(1, (int)((window.getSize().x - GRID_GAP) / pitch.x));
+        float left = round((window.getSize().x - columns * pitch.x + GRID_GAP) / 2);
+        return { columns, pitch, left };
+    }
+
+    // The page in the grid cell at window position `point`, if any.
+    int gridPageAt(sf::Vector2f point) {
+        auto [columns, pitch, left] = gridLayout();
+        float x = point.x - left, y = point.y + grid_scroll - GRID_GAP;
+        int column = floor(x / pitch.x), row = floor(y / pitch.y);
+        if (x < 0 || y < 0 || column >= columns || fmod(x, pitch.x) > Thumbnails::WIDTH || fmod(y, pitch.y) > Thumbnails::HEIGHT) {
+            return -1;
+        }
+        int page = row * columns + column;
+        return page < page_count ? page : -1;
+    }
+
+    // Range of pages [lo, hi) in grid rows that intersect the window.
+    std::pair<int, int> visibleGridPages() {
+        auto [columns, pitch, left] = gridLayout();
+        int rows = (page_count + columns - 1) / columns;
+        float bottom = rows * pitch.y + GRID_GAP - window.getSize().y;
+        grid_scroll = std::clamp(grid_scroll, 0.0f, std::max(bottom, 0.0f));
+
+        int first_row = std::max(0, (int)floor((grid_scroll - GRID_GAP) / pitch.y));
+        int last_row = (int)ceil((grid_scroll + window.getSize().y) / pitch.y);
+        return { std::min(first_row * columns, page_count), std::min(last_row * columns, page_count) };
+    }
+
+    void updateGrid() {
+        auto [lo, hi] = visibleGridPages();
+        if (thumbnails->update(lo, hi)) {
+            requestRedraw();
+        }
+    }
+
+    // Thumbnails not made yet are drawn as grey boxes, and the current page
+    // is outlined.
+    void drawGrid() {
+        auto [columns, pitch, left] = gridLayout();
+        auto [lo, hi] = visibleGridPages();
+        for (int page = lo; page < hi; ++page) {
+            sf::Vector2f cell = {
+                left + page % columns * pitch.x,
+                GRID_GAP + page / columns * pitch.y - grid_scroll,
+            };
+            if (std::optional<sf::Sprite> sprite = thumbnails->sprite(page)) {
+                sf::Vector2f size = sprite->getGlobalBounds().size;
+                sprite->setPosition({
+                    (float)round(cell.x + (Thumbnails::WIDTH - size.x) / 2),
+                    (float)round(cell.y + (Thumbnails::HEIGHT - size.y) / 2),
+                });
+                window.draw(*sprite);
+            } else {
+                sf::RectangleShape placeholder({ (float)Thumbnails::WIDTH, (float)Thumbnails::HEIGHT });
+                placeholder.setFillColor(sf::Color(48, 48, 48));
+                placeholder.setPosition(cell);
+                window.draw(placeholder);
+            }
+            if (page == settings.current_page) {
+                sf::RectangleShape outline({ (float)Thumbnails::WIDTH, (float)Thumbnails::HEIGHT });
+                outline.setFillColor(sf::Color::Transparent);
+                outline.setOutlineColor(sf::Color(255, 200, 0));
+                outline.setOutlineThickness(3);
+                outline.setPosition(cell);
+                window.draw(outline);
+            }
+        }
+    }
+
+    // The grid takes the wheel, clicks and scrolling keys while it's open.
+    // Returns whether it used `event`.
+    bool handleGridEvent(const sf::Event& event) {
+        if (const auto* mousePress = event.getIf<sf::Event::MouseButtonPressed>()) {
+            int page = gridPageAt(sf::Vector2f(mousePress->position));
+            if (mousePress->button == sf::Mouse::Button::Left && page >= 0) {
+                settings.current_page = page;
+                if (settings.dual_mode && !settings.continuous && settings.current_page % 2 == 1) {
+                    settings.current_page -= 1;
+                }
+                setGrid(false);
+                renderPage();
+            }
+            return true;
+        } else if (const auto* mouseWheel = event.getIf<sf::Event::MouseWheelScrolled>()) {
+            grid_scroll -= mouseWheel->delta * SCROLL_STEP;
+            return true;
+        } else if (const auto* keyPressed = event.getIf<sf::Event::KeyPressed>()) {
+            switch (keyPressed->scancode) {
+            case sf::Keyboard::Scancode::Up:
+                grid_scroll -= SCROLL_STEP;
+                return true;
+            case sf::Keyboard::Scancode::Down:
+                grid_scroll += SCROLL_STEP;
+                return true;
+            case sf::Keyboard::Scancode::Escape:
+                setGrid(false);
+                return true;
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Enter in the search field: a new query starts a search from the
+    // current page, the same one goes on to the next match.
+    void submitSearch() {
+        if (search_text[0] && lowercase(search_text) == search->query() && !search->cancelled()) {
+            stepMatch(1);
+            return;
+        }
+        search_matches.clear();
+        search_match_count = 0;
+        current_match = { -1, 0 };
+        if (search_text[0]) {
+            search->start(search_text, settings.current_page);
+        } else {
+            search->reset();
+        }
+        requestRedraw();
+    }
+
+    void updateSearch() {
+        std::vector<SearchMatch> found = search->take();
+        if (found.empty()) {
+            return;
+        }
+        for (SearchMatch& match : found) {
+            search_matches[match.page].push_back(std::move(match));
+        }
+        search_match_count += found.size();
+        if (current_match.first < 0) {
+            gotoMatch({ found[0].page, 0 });
+        }
+        requestRedraw();
+    }
+
+    void gotoMatch(std::pair<int, int> match) {
+        current_match = match;
+        if (match.first != settings.current_page) {
+            settings.current_page = match.first;
+            if (settings.dual_mode && !settings.continuous && settings.current_page % 2 == 1) {
+                settings.current_page -= 1;
+            }
+            renderPage();
+        }
+        requestRedraw();
+    }
+
+    // Moves `direction` (1 or -1) matches on, in reading order, wrapping
+    // around at either end.
+    void stepMatch(int direction) {
+        if (search_matches.empty()) {
+            return;
+        }
+        auto [page, index] = current_match;
+        auto it = search_matches.find(page);
+        if (it == search_matches.end()) {
+            it = search_matches.lower_bound(page);
+            if (it == search_matches.end()) {
+                it = search_matches.begin();
+            }
+            gotoMatch({ it->first, 0 });
+            return;
+        }
+        index += direction;
+        if (index < 0) {
+            it = it == search_matches.begin() ? std::prev(search_matches.end()) : std::prev(it);
+            index = it->second.size() - 1;
+        } else if (index >= it->second.size()) {
+            it = std::next(it) == search_matches.end() ? search_matches.begin() : std::next(it);
+            index = 0;
+        }
+        gotoMatch({ it->first, index });
+    }
 
-        auto t2 = high_resolution_clock::now();
-        std::cout << duration_cast<milliseconds>(t2 - t1) << " to render" << std::endl;
+    // Draws the matches on `page`, whose top-left corner is at `origin` and
+    // which is shown at `scale` times its size at zoom 1.
+    void drawHighlights(int page, sf::Vector2f origin, float scale) {
+        auto it = search_matches.find(page);
+        if (it == search_matches.end()) {
+            return;
+        }
+        for (int i = 0; i < it->second.size(); ++i) {
+            bool current = current_match == std::pair(page, i);
+            for (const sf::FloatRect& box : it->second[i].boxes) {
+                sf::RectangleShape highlight(box.size * scale);
+                highlight.setPosition(origin + box.position * scale);
+                highlight.setFillColor(current ? sf::Color(255, 120, 0, 110) : sf::Color(255, 220, 0, 90));
+                window.draw(highlight);
+            }
+        }
     }
 
     void renderGUI() {
@@ -176,8 +959,87 @@ private:
                 ImGui::EndMenu();
             }
 
+            if (ImGui::BeginMenu("Cache")) {
+                PageCache::Stats stats = page_cache.stats();
+                ImGui::Text("Pages: %zu (%.1f MB)", stats.entries, stats.bytes / 1e6);
+                ImGui::Text("Hits: %zu  Misses: %zu  Evictions: %zu", stats.hits, stats.misses, stats.evictions);
+                if (stats.reserved > 0) {
+                    ImGui::Text("Held by the backend: %.1f MB", stats.reserved / 1e6);
+                }
+                BufferPool::Stats pool_stats = buffers.stats();
+                ImGui::Separator();
+                ImGui::Text("Idle buffers: %zu (%.1f MB)", pool_stats.idle_blocks, pool_stats.idle_bytes / 1e6);
+                ImGui::Text("Allocations: %zu  Reuses: %zu", pool_stats.allocations, pool_stats.reuses);
+                auto [indexed, pages] = text_index->progress();
+                ImGui::Separator();
+                if (text_index->ready()) {
+                    ImGui::Text("Text index: ready");
+                } else {
+                    ImGui::Text("Text index: %d/%d pages", indexed, pages);
+                }
+                if (auto* pdf = dynamic_cast<PDF*>(backend)) {
+                    PDF::DisplayListStats lists = pdf->display_list_stats();
+                    ImGui::Separator();
+                    ImGui::Text("Display lists: %zu (%.1f MB)", lists.entries, lists.bytes / 1e6);
+                    ImGui::Text("Hits: %zu  Misses: %zu  Evictions: %zu", lists.hits, lists.misses, lists.evictions);
+                }
+                if (auto* cbz = dynamic_cast<CBZ*>(backend)) {
+                    CBZ::DecodeStats decodes = cbz->decode_stats();
+                    ImGui::Separator();
+                    ImGui::Text("Decoded pages: %zu (%.1f MB)", decodes.entries, decodes.bytes / 1e6);
+                    ImGui::Text("Hits: %zu  Misses: %zu  Evictions: %zu", decodes.hits, decodes.misses, decodes.evictions);
+                    ImGui::Text("Decode: %.1f ms (average %.1f ms)", decodes.last_decode_ms, decodes.average_decode_ms);
+                    ImGui::Text("Resample: %.1f ms (average %.1f ms)", decodes.last_resample_ms, decodes.average_resample_ms);
+                }
+                ImGui::EndMenu();
+            }
+
+            if (ImGui::BeginMenu("View")) {
+                if (ImGui::MenuItem("Continuous scroll", "C", settings.continuous)) {
+                    setContinuous(!settings.continuous);
+                }
+                if (ImGui::MenuItem("Page overview", "O", grid)) {
+                    setGrid(!grid);
+                }
+                ImGui::MenuItem("Redraw only on changes", nullptr, &redraw_on_demand);
+                ImGui::Text("Frames drawn: %zu", frames_drawn);
+                TexturePool::Stats texture_stats = textures.stats();
+                ImGui::Separator();
+                ImGui::Text("Page textures: %zu (%.1f MB)", texture_stats.textures, texture_stats.bytes / 1e6);
+                ImGui::Text("Upload: %.2f ms (average %.2f ms, %s)", texture_stats.last_upload_ms,
+                    texture_stats.average_upload_ms, texture_stats.async ? "async" : "sync");
+                ImGui::EndMenu();
+            }
+
             ImGui::Text("Page: %d/%d", settings.current_page + 1, page_count);
 
+            ImGui::SameLine();
+            ImGui::SetNextItemWidth(200);
+            if (focus_search) {
+                ImGui::SetKeyboardFocusHere();
+                focus_search = false;
+            }
+            if (ImGui::InputText("##search", search_text, sizeof(search_text), ImGuiInputTextFlags_EnterReturnsTrue)) {
+                submitSearch();
+            }
+            if (!search->query().empty()) {
+                ImGui::SameLine();
+                if (ImGui::Button("<")) {
+                    stepMatch(-1);
+                }
+                ImGui::SameLine();
+                if (ImGui::Button(">")) {
+                    stepMatch(1);
+                }
+                auto [searched, pages] = search->progress();
+                ImGui::SameLine();
+                if (searched < pages) {
+                    ImGui::Text("%zu matches (%d/%d pages)", search_match_count, searched, pages);
+                } else {
+                    ImGui::Text("%zu matches", search_match_count);
+                }
+            }
+
             float rightAlignPos = ImGui::GetWindowWidth() - ImGui::CalcTextSize(filename).x - ImGui::GetStyle().ItemSpacing.x;
             ImGui::SameLine();
             ImGui::SetCursorPosX(rightAlignPos);
@@ -188,11 +1050,14 @@ private:
     }
 
     sf::Vector2f lastMousePos;
-    bool isPanning = false, shifting = false;
+    bool isPanning = false, shifting = false, controlling = false;
     sf::Keyboard::Scan lastScanCode;
     void handleEvent(const sf::Event& event) {
         ImGuiIO& io = ImGui::GetIO();
 
+        if (grid && !io.WantCaptureMouse && !io.WantCaptureKeyboard && handleGridEvent(event)) {
+            return;
+        }
         if (event.is<sf::Event::Closed>()) {
             window.close();
         } else if (const auto* mousePress = event.getIf<sf::Event::MouseButtonPressed>()) {
@@ -219,10 +1084,16 @@ private:
             if (keyReleased->scancode == sf::Keyboard::Scancode::LShift) {
                 shifting = false;
             }
+            if (keyReleased->scancode == sf::Keyboard::Scancode::LControl) {
+                controlling = false;
+            }
         } else if (const auto* keyPressed = event.getIf<sf::Event::KeyPressed>()) {
             if (keyPressed->scancode == sf::Keyboard::Scancode::LShift) {
                 shifting = true;
             }
+            if (keyPressed->scancode == sf::Keyboard::Scancode::LControl) {
+                controlling = true;
+            }
             if (io.WantCaptureKeyboard)
                 return;
 
@@ -252,13 +1123,28 @@ private:
                 break;
             case sf::Keyboard::Scancode::Up:
             case sf::Keyboard::Scancode::Equal:
-                zoomIn();
-                renderPage();
+                if (settings.continuous && keyPressed->scancode == sf::Keyboard::Scancode::Up) {
+                    scroll_y -= SCROLL_STEP;
+                } else {
+                    zoomStep(true);
+                }
                 break;
             case sf::Keyboard::Scancode::Down:
             case sf::Keyboard::Scancode::Hyphen:
-                zoomOut();
-                renderPage();
+                if (settings.continuous && keyPressed->scancode == sf::Keyboard::Scancode::Down) {
+                    scroll_y += SCROLL_STEP;
+                } else {
+                    zoomStep(false);
+                }
+                break;
+            case sf::Keyboard::Scancode::C:
+                setContinuous(!settings.continuous);
+                break;
+            case sf::Keyboard::Scancode::O:
+                setGrid(!grid);
+                break;
+            case sf::Keyboard::Scancode::Slash:
+                focus_search = true;
                 break;
             case sf::Keyboard::Scancode::T:
                 subpixel = !subpixel;
@@ -285,22 +1171,21 @@ private:
         } else if (const auto* ev = event.getIf<sf::Event::Resized>()) {
             sf::FloatRect visibleArea({ 0, 0 }, { (float)ev->size.x, (float)ev->size.y });
             window.setView(sf::View(visibleArea));
-            renderPage();
+            renderPageLater(false);
         } else if (const auto* mouseWheel = event.getIf<sf::Event::MouseWheelScrolled>()) {
             if (io.WantCaptureMouse)
                 return;
-            if (mouseWheel->delta < 0) {
-                zoomOut();
-                renderPage();
+            // in continuous mode the wheel scrolls, and zooms with Ctrl held.
+            if (settings.continuous && !controlling) {
+                scroll_y -= mouseWheel->delta * SCROLL_STEP;
             } else {
-                zoomIn();
-                renderPage();
+                zoomStep(mouseWheel->delta > 0);
             }
         }
     }
 
     void zoomIn() {
-        if (settings.zoom < 2) {
+        if (settings.zoom < MAX_ZOOM) {
             settings.zoom *= 1.2;
         }
     }
@@ -311,28 +1196,30 @@ private:
         }
     }
 
+    // Deep zoom and continuous mode show a single page even in dual mode.
+    void stepSpreads(int steps) {
+        if (pending_steps == 0 || steps_from != settings.current_page) {
+            steps_from = settings.current_page;
+            pending_steps = 0;
+        }
+        pending_steps += steps;
+        renderPage();
+    }
+
     void nextPage() {
-        if (settings.dual_mode) {
-            if (is_current_page_large) {
-                if (settings.current_page + 1 < page_count) {
-                    settings.current_page += 1;
-                }
-            } else {
-                if (settings.current_page + 2 < page_count) {
-                    settings.current_page += 2;
-                }
-            }
+        if (settings.dual_mode && !tiled && !settings.continuous) {
+            stepSpreads(1);
         } else {
             if (settings.current_page + 1 < page_count) {
                 settings.current_page += 1;
             }
+            renderPage();
         }
-        renderPage();
     }
 
     void previousPage() {
-        if (settings.dual_mode) {
-            renderPage(true);
+        if (settings.dual_mode && !tiled && !settings.continuous) {
+            stepSpreads(-1);
         } else {
             if (settings.current_page > 0) {
                 settings.current_page -= 1;
@@ -344,6 +1231,30 @@ private:
 public:
     ~PDFViewer() {
         metadata.save(filename, settings);
+
+        // jobs on the pool use the backend, the caches and the objects
+        // below, so everything that submits them is stopped, what's in
+        // flight is called off, and the pool drained before deleting any.
+        renderer->stop();
+        if (measure_token) {
+            measure_token->cancel();
+        }
+        for (auto& [page, pending] : pending_pages) {
+            pending.token->cancel();
+        }
+        for (auto& [key, pending] : pending_tiles) {
+            pending.token->cancel();
+        }
+        prefetcher->cancel();
+        delete thumbnails; // these three wait for their own jobs
+        delete search;
+        delete text_index;
+        pool.wait_idle();
+
+        delete renderer;
+        delete prefetcher;
+        delete disk_cache;
+        delete backend;
     }
 
     PDFViewer(const char* filename)
@@ -362,9 +1273,18 @@ public:
 
         toc = backend->load_outline();
         page_count = backend->count_pages();
+        disk_cache = new DiskCache(filename);
+        prefetcher = new Prefetcher(backend, pool, buffers, page_cache);
+        text_index = new TextIndex(metadata.text_index(disk_cache->fingerprint()), page_count);
+        text_index->build(backend, pool);
+        search = new Search(backend, pool, text_index);
+        renderer = new PageRenderer(backend, pool, buffers, page_cache, disk_cache);
 
         metadata.init();
         settings = metadata.query(filename);
+        if (settings.continuous) {
+            measurePages();
+        }
     }
 
     void run() {
@@ -373,28 +1293,97 @@ public:
         window.setFramerateLimit(60);
 
         auto _ = ImGui::SFML::Init(window);
+        if (settings.continuous) {
+            scroll_y = layout.top(settings.current_page) * settings.zoom;
+        }
         renderPage();
+        startRender();
 
         sf::Clock deltaClock;
         while (window.isOpen()) {
+            auto process = [&](const sf::Event& event) {
+                ImGui::SFML::ProcessEvent(window, event);
+                handleEvent(event);
+                requestRedraw(3);
+            };
+
+            // Sleep until there's input. While renders are in flight wake up
+            // now and then to collect them; otherwise only for a blinking
+            // text cursor.
+            if (redraw_on_demand && frames_to_draw == 0) {
+                bool blinking = ImGui::GetIO().WantTextInput;
+                if (const std::optional event = window.waitEvent(sf::milliseconds(busy() ? 10 : 500))) {
+                    process(event.value());
+                } else if (blinking) {
+                    requestRedraw();
+                }
+            }
             while (const std::optional event = window.pollEvent()) {
                 if (event.has_value()) {
-                    ImGui::SFML::ProcessEvent(window, event.value());
-                    handleEvent(event.value());
+                    process(event.value());
                 }
             }
-            ImGui::SFML::Update(window, deltaClock.restart());
+            if (!redraw_on_demand) {
+                requestRedraw();
+            }
+
+            if (render_pending && std::chrono::steady_clock::now() >= render_at) {
+                startRender();
+            }
+            updateRender();
+            page_cache.set_reserved(backend->cached_bytes());
+            prefetcher->update();
+            if (tiled) {
+                updateTiles();
+            }
+            updateLayout();
+            updateSearch();
+            if (settings.continuous) {
+                updateScroll();
+            }
+            if (grid) {
+                updateGrid();
+            }
+            if (frames_to_draw == 0) {
+                continue;
+            }
+            frames_to_draw -= 1;
+            frames_drawn += 1;
 
+            ImGui::SFML::Update(window, deltaClock.restart());
             renderGUI();
             if (isPanning) {
                 sf::Vector2i mousePos = sf::Mouse::getPosition(window);
                 sf::Vector2f delta = sf::Vector2f(mousePos) - lastMousePos;
-                page_sprite->move(delta);
+                if (settings.continuous) {
+                    scroll_x += delta.x;
+                    scroll_y -= delta.y;
+                } else if (tiled) {
+                    tiled_origin += delta;
+                    if (delta != sf::Vector2f()) {
+                        pan_direction = delta;
+                    }
+                } else {
+                    for (ShownPage& page : shown_pages) {
+                        page.sprite.move(delta);
+                    }
+                }
                 lastMousePos = sf::Vector2f(mousePos);
             }
 
             window.clear(sf::Color::Black);
-            window.draw(*page_sprite);
+            if (grid) {
+                drawGrid();
+            } else if (settings.continuous) {
+                drawScroll();
+            } else if (tiled) {
+                drawTiles();
+            } else {
+                for (const ShownPage& page : shown_pages) {
+                    window.draw(page.sprite);
+                    drawHighlights(page.page, page.sprite.getPosition(), settings.zoom);
+                }
+            }
             ImGui::SFML::Render(window);
             window.display();
         }
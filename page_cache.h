@@ -0,0 +1,124 @@
+#include "backends/backend.h"
+
+#include <cmath>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#pragma once
+
+// zoomIn()/zoomOut() step along powers of 1.2, but repeated float
+// multiplication drifts a little. With `snap` on, zooms within about a
+// percent of a step map to that step. Steps are returned as negative numbers
+// so they can't collide with other zooms, which are kept to four decimal
+// places.
+long quantize_zoom(float zoom, bool snap) {
+    double step = log(zoom) / log(1.2);
+    if (snap && fabs(step - round(step)) < 0.05) {
+        return -(long)round(step) - 1'000'000;
+    }
+    return lround(zoom * 10000);
+}
+
+// Finished page bitmaps, so flipping back a page or toggling dual mode and
+// back doesn't render anything again. Bounded by `budget` bytes, evicting
+// the least recently used page first. Memory the backend keeps for rendering
+// (see Backend::cached_bytes()) can be set aside out of the budget with
+// set_reserved().
+class PageCache {
+public:
+    struct Stats {
+        size_t hits = 0, misses = 0, evictions = 0;
+        size_t entries = 0, bytes = 0;
+        size_t reserved = 0;
+    };
+
+    size_t budget;
+
+    // See quantize_zoom().
+    bool snap_zoom = true;
+
+private:
+    struct Key {
+        const Backend* backend;
+        int page;
+        long zoom; // see quantize_zoom()
+        bool subpixel;
+
+        auto operator<=>(const Key&) const = default;
+    };
+
+    std::list<std::pair<Key, std::shared_ptr<const PixelBuffer>>> entries; // most recent first
+    std::map<Key, decltype(entries)::iterator> index;
+    Stats counters;
+    std::mutex mutex;
+
+    static size_t cost(const PixelBuffer& image) {
+        return image.bytes();
+    }
+
+    // Evicts pages until `size` more bytes fit.
+    void make_room(size_t size) {
+        while (!entries.empty() && counters.bytes + counters.reserved + size > budget) {
+            counters.bytes -= cost(*entries.back().second);
+            index.erase(entries.back().first);
+            entries.pop_back();
+            counters.evictions += 1;
+        }
+    }
+
+public:
+    PageCache(size_t budget)
+        : budget { budget } { }
+
+    std::shared_ptr<const PixelBuffer> find(const Backend* backend, int page, float zoom, bool subpixel) {
+        std::lock_guard lock(mutex);
+        auto it = index.find({ backend, page, quantize_zoom(zoom, snap_zoom), subpixel });
+        if (it == index.end()) {
+            counters.misses += 1;
+            return nullptr;
+        }
+        counters.hits += 1;
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->second;
+    }
+
+    // Like find(), but doesn't count towards the statistics or the LRU order.
+    bool contains(const Backend* backend, int page, float zoom, bool subpixel) {
+        std::lock_guard lock(mutex);
+        return index.contains({ backend, page, quantize_zoom(zoom, snap_zoom), subpixel });
+    }
+
+    void insert(const Backend* backend, int page, float zoom, bool subpixel, std::shared_ptr<const PixelBuffer> image) {
+        std::lock_guard lock(mutex);
+        Key key = { backend, page, quantize_zoom(zoom, snap_zoom), subpixel };
+        if (auto it = index.find(key); it != index.end()) {
+            counters.bytes -= cost(*it->second->second);
+            entries.erase(it->second);
+            index.erase(it);
+        }
+
+        size_t size = cost(*image);
+        make_room(size);
+        if (counters.reserved + size > budget) {
+            return;
+        }
+
+        entries.emplace_front(key, std::move(image));
+        index[key] = entries.begin();
+        counters.bytes += size;
+    }
+
+    void set_reserved(size_t bytes) {
+        std::lock_guard lock(mutex);
+        counters.reserved = bytes;
+        make_room(0);
+    }
+
+    Stats stats() {
+        std::lock_guard lock(mutex);
+        counters.entries = entries.size();
+        return counters;
+    }
+};
@@ -0,0 +1,321 @@
+#include "backends/backend.h"
+#include "buffer_pool.h"
+#include "disk_cache.h"
+#include "page_cache.h"
+#include "render_pool.h"
+#include "spsc_queue.h"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+struct PageRequest {
+    uint64_t id;
+    int page;
+    int steps; // in dual mode, spreads to step from `page` first; negative for backwards
+    bool dual_mode;
+    float zoom;
+    bool subpixel;
+    bool tiled;
+};
+
+struct PageResult {
+    enum Stage {
+        Preview, // quick low resolution version of the page, shown stretched
+        Full,
+        Tiled, // only the layout; the viewer renders the tiles itself
+    };
+
+    uint64_t id;
+    Stage stage;
+    int page; // the left page of the spread
+    bool large;
+    std::vector<int> spread;
+    sf::Vector2u shown_size; // size of the spread at the requested zoom
+    // One image per page of the spread, each to be stretched to its shown
+    // size. A preview may mix low resolution pages with finished ones from
+    // the cache.
+    std::vector<std::shared_ptr<const PixelBuffer>> halves;
+    std::vector<sf::Vector2u> shown_sizes;
+    double seconds;
+    bool rendered; // false if the full images came from a cache
+};
+
+// Owns the thread that lays out and renders spreads, so that the
+// thread driving the window only uploads textures and draws. Requests come
+// in and results go out through lock-free single-producer queues; when the
+// renderer finds newer requests waiting it abandons the one it's on, so only
+// the latest target is finished.
+class PageRenderer {
+public:
+    // Each page is first shown from a render at PREVIEW_SCALE of the zoom
+    // without subpixel rendering, stretched on the GPU, while the full
+    // quality render runs on the pool.
+    static constexpr float PREVIEW_SCALE = 0.25;
+
+private:
+    using clock = std::chrono::high_resolution_clock;
+
+    Backend* backend;
+    RenderPool& pool;
+    BufferPool& buffers;
+    PageCache& cache;
+    DiskCache* disk_cache;
+    int page_count;
+
+    SPSCQueue<PageRequest, 64> requests;
+    SPSCQueue<PageResult, 64> results;
+    std::atomic<uint64_t> requests_pushed = 0; // what the render thread sleeps on
+    std::atomic<bool> stopping = false;
+    std::atomic<bool> working = false;
+    std::thread thread;
+
+    bool superseded() const {
+        return stopping || !requests.empty();
+    }
+
+    void post(PageResult&& result) {
+        while (!results.push(std::move(result))) {
+            if (stopping) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    // Renders the given pages on the pool, or previews of them at
+    // PREVIEW_SCALE of `zoom`. Gives up, cancelling whatever's still
+    // running, and returns false if a newer request comes in first.
+    bool renderHalves(const std::vector<int>& pages, float zoom, bool subpixel, bool preview,
+        std::vector<std::shared_ptr<const PixelBuffer>>& halves) {
+        auto token = std::make_shared<RenderToken>();
+        std::vector<std::future<std::shared_ptr<const PixelBuffer>>> futures;
+        for (int i = 0; i < pages.size(); ++i) {
+            if (halves[i]) {
+                futures.emplace_back();
+                continue;
+            }
+            futures.push_back(pool.submit([this, page_number = pages[i], zoom, subpixel, preview, token]() -> std::shared_ptr<const PixelBuffer> {
+                if (preview) {
+                    auto image = buffers.acquire(backend->page_size(page_number, zoom * PREVIEW_SCALE));
+                    backend->render_preview(page_number, zoom * PREVIEW_SCALE, zoom, sf::IntRect({ 0, 0 }, sf::Vector2i(image->size)), *image, token.get());
+                    return image;
+                }
+                auto image = buffers.acquire(backend->page_size(page_number, zoom));
+                backend->render_into(page_number, zoom, subpixel, sf::IntRect({ 0, 0 }, sf::Vector2i(image->size)), *image, token.get());
+                return image;
+            }));
+        }
+
+        for (int i = 0; i < pages.size(); ++i) {
+            if (!futures[i].valid()) {
+                continue;
+            }
+            while (futures[i].wait_for(std::chrono::milliseconds(2)) != std::future_status::ready) {
+                if (superseded()) {
+                    token->cancel();
+                    return false;
+                }
+            }
+            halves[i] = futures[i].get();
+        }
+        return true;
+    }
+
+    // Steps `steps` spreads from the one starting at `page`, landing where
+    // as many presses of next or previous page would have one at a time.
+    // Returns the page to show and whether it was reached going backwards,
+    // in which case it's paired with the page before it.
+    std::pair<int, bool> step(int page, int steps, float zoom) {
+        auto large = [&](int page) {
+            auto [w, h] = backend->page_size(page, zoom);
+            return w > h;
+        };
+        bool backwards = false;
+        for (int i = 0; i < std::abs(steps); ++i) {
+            if (backwards && !large(page) && page > 0) {
+                page -= 1; // where the last step back's spread starts
+            }
+            backwards = false;
+            if (steps > 0) {
+                int next = page + (large(page) ? 1 : 2);
+                if (next < page_count) {
+                    page = next;
+                }
+            } else if (page > 0) {
+                page -= 1;
+                backwards = true;
+            }
+        }
+        return { page, backwards };
+    }
+
+    void process(const PageRequest& request) {
+        auto t1 = clock::now();
+        PageResult result = {};
+        result.id = request.id;
+
+        if (request.tiled) {
+            result.stage = PageResult::Tiled;
+            result.page = request.page;
+            result.shown_size = backend->page_size(request.page, request.zoom);
+            result.large = result.shown_size.x > result.shown_size.y;
+            post(std::move(result));
+            return;
+        }
+
+        // In dual mode the other half of the spread is the page before the
+        // current one when stepping backwards, else the page after, unless
+        // the current page is a wide one that fills the spread on its own.
+        auto [page, backwards] = step(request.page, request.steps, request.zoom);
+        auto [w, h] = backend->page_size(page, request.zoom);
+        result.large = w > h;
+        int partner = page + (backwards ? -1 : 1);
+        std::vector<int> spread = { page };
+        if (!result.large && request.dual_mode && 0 <= partner && partner < page_count) {
+            if (backwards) {
+                page -= 1;
+            }
+            spread = { page, page + 1 };
+        }
+        result.page = page;
+        result.spread = spread;
+        for (int page_number : spread) {
+            auto [pw, ph] = backend->page_size(page_number, request.zoom);
+            result.shown_sizes.push_back({ pw, ph });
+            result.shown_size = { result.shown_size.x + pw, std::max(result.shown_size.y, ph) };
+        }
+
+        std::vector<std::shared_ptr<const PixelBuffer>> cached;
+        for (int page_number : spread) {
+            auto image = cache.find(backend, page_number, request.zoom, request.subpixel);
+            if (!image && (image = disk_cache->load(page_number, request.zoom, request.subpixel, buffers))) {
+                cache.insert(backend, page_number, request.zoom, request.subpixel, image);
+            }
+            cached.push_back(image);
+        }
+        if (std::all_of(cached.begin(), cached.end(), [](const auto& image) { return image != nullptr; })) {
+            result.stage = PageResult::Full;
+            result.halves = cached;
+            result.seconds = std::chrono::duration<double>(clock::now() - t1).count();
+            post(std::move(result));
+            return;
+        }
+
+        // First pass: a cheap preview of the pages that aren't cached.
+        std::vector<std::shared_ptr<const PixelBuffer>> previews = cached;
+        if (!renderHalves(spread, request.zoom, false, true, previews)) {
+            return;
+        }
+        PageResult preview = result;
+        preview.stage = PageResult::Preview;
+        preview.halves = previews;
+        preview.seconds = std::chrono::duration<double>(clock::now() - t1).count();
+        post(std::move(preview));
+
+        // Second pass: the real thing.
+        auto t2 = clock::now();
+        std::vector<std::shared_ptr<const PixelBuffer>> halves = cached;
+        if (!renderHalves(spread, request.zoom, request.subpixel, false, halves)) {
+            return;
+        }
+        for (int i = 0; i < spread.size(); ++i) {
+            if (cached[i]) {
+                continue;
+            }
+            cache.insert(backend, spread[i], request.zoom, request.subpixel, halves[i]);
+            pool.submit([this, half = halves[i], page_number = spread[i], zoom = request.zoom, subpixel = request.subpixel] {
+                disk_cache->store(page_number, zoom, subpixel, *half);
+            },
+                RenderPool::Priority::Background);
+        }
+
+        result.stage = PageResult::Full;
+        result.halves = halves;
+        result.seconds = std::chrono::duration<double>(clock::now() - t2).count();
+        result.rendered = true;
+        post(std::move(result));
+    }
+
+    void run() {
+        while (!stopping) {
+            uint64_t seen = requests_pushed;
+
+            // only the newest request matters.
+            working = true;
+            PageRequest request;
+            bool any = false;
+            while (requests.pop(request)) {
+                any = true;
+            }
+            if (!any) {
+                working = false;
+                requests_pushed.wait(seen);
+                continue;
+            }
+
+            try {
+                process(request);
+            } catch (const RenderCancelled&) {
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            working = false;
+        }
+    }
+
+public:
+    PageRenderer(Backend* backend, RenderPool& pool, BufferPool& buffers, PageCache& cache, DiskCache* disk_cache)
+        : backend { backend }
+        , pool { pool }
+        , buffers { buffers }
+        , cache { cache }
+        , disk_cache { disk_cache }
+        , page_count { backend->count_pages() } {
+        thread = std::thread([this] { run(); });
+    }
+
+    ~PageRenderer() {
+        stop();
+    }
+
+    // Joins the render thread, so no more jobs are submitted. Jobs already
+    // on the pool still use the renderer until they're done.
+    void stop() {
+        if (!thread.joinable()) {
+            return;
+        }
+        stopping = true;
+        requests_pushed += 1;
+        requests_pushed.notify_one();
+        thread.join();
+    }
+
+    // Called from the UI thread only. Returns false if the queue is full.
+    bool request(PageRequest&& request) {
+        if (!requests.push(std::move(request))) {
+            return false;
+        }
+        requests_pushed += 1;
+        requests_pushed.notify_one();
+        return true;
+    }
+
+    // Called from the UI thread only.
+    bool poll(PageResult& result) {
+        return results.pop(result);
+    }
+
+    // Whether there are requests in progress or results not yet polled.
+    bool busy() const {
+        return working || !requests.empty() || !results.empty();
+    }
+};
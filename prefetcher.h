@@ -0,0 +1,206 @@
+#include "backends/backend.h"
+#include "buffer_pool.h"
+#include "page_cache.h"
+#include "render_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <map>
+#include <memory>
+#include <vector>
+
+#pragma once
+
+struct RenderKey {
+    int page;
+    float zoom;
+    bool subpixel;
+
+    auto operator<=>(const RenderKey&) const = default;
+};
+
+// Renders the pages the reader is likely to want next in the background and
+// puts them in the page cache, so that turning to them doesn't have to wait
+// for the backend.
+//
+// It watches page turns to learn which way the reader is going and how fast,
+// and looks far enough ahead to cover the time a render takes: a reader who
+// turns a page every second through pages that take 400 ms needs less
+// lookahead than one flicking through 2 s renders. Once those pages are done
+// it renders the current page one zoom step in and out as well.
+class Prefetcher {
+private:
+    static constexpr int MAX_DEPTH = 8;
+
+    Backend* backend;
+    RenderPool& pool;
+    BufferPool& buffers;
+    PageCache& cache;
+
+    using clock = std::chrono::steady_clock;
+
+    // reading model
+    int last_page = -1;
+    clock::time_point last_turn;
+    double direction = 1; // moving average of the sign of each page turn
+    double seconds_per_turn = 2;
+    double seconds_per_render = 0.2;
+    double zoom_trend = 0; // > 0 if the reader has been zooming in
+
+    // what to prefetch, most wanted first
+    std::vector<RenderKey> targets;
+    struct Pending {
+        std::future<std::pair<std::shared_ptr<PixelBuffer>, double>> result; // image, seconds taken
+        std::shared_ptr<RenderToken> token;
+    };
+    std::map<RenderKey, Pending> pending;
+
+    struct {
+        int page = -1, step = 1;
+        float zoom = 1;
+        bool subpixel = true;
+        float max_zoom = 1;
+    } current;
+
+    int depth() const {
+        return std::clamp((int)ceil(seconds_per_render / seconds_per_turn) + 1, 1, MAX_DEPTH);
+    }
+
+    void plan() {
+        int page_count = backend->count_pages();
+        auto [page, step, zoom, subpixel, max_zoom] = current;
+
+        targets.clear();
+        auto add = [&](int page_number, float zoom) {
+            if (0 <= page_number && page_number < page_count) {
+                targets.push_back({ page_number, zoom, subpixel });
+            }
+        };
+
+        // the next `depth` spreads in the reading direction, then the one
+        // going the other way in case the reader turns back.
+        int forward = direction >= 0 ? 1 : -1;
+        for (int i = 0; i < depth() * step; ++i) {
+            add(forward > 0 ? page + step + i : page - 1 - i, zoom);
+        }
+        for (int i = 0; i < step; ++i) {
+            add(forward > 0 ? page - 1 - i : page + step + i, zoom);
+        }
+
+        // the same zoom steps as zoomIn()/zoomOut(), likeliest first.
+        float zoom_in = zoom * 1.2, zoom_out = zoom / 1.2;
+        std::vector<float> zooms;
+        if (zoom_in <= max_zoom) {
+            zooms.push_back(zoom_in);
+        }
+        zooms.insert(zoom_trend < 0 ? zooms.begin() : zooms.end(), zoom_out);
+        for (float z : zooms) {
+            for (int i = 0; i < step; ++i) {
+                add(page + i, z);
+            }
+        }
+
+        // the reader has moved on from anything else still in flight.
+        std::erase_if(pending, [&](auto& entry) {
+            if (std::find(targets.begin(), targets.end(), entry.first) != targets.end()) {
+                return false;
+            }
+            entry.second.token->cancel();
+            return true;
+        });
+    }
+
+public:
+    Prefetcher(Backend* backend, RenderPool& pool, BufferPool& buffers, PageCache& cache)
+        : backend { backend }
+        , pool { pool }
+        , buffers { buffers }
+        , cache { cache } { }
+
+    // Tells the prefetcher the reader is now at `page`. Jumps (bookmarks,
+    // the table of contents, G) move the reading position without saying
+    // anything about direction or speed.
+    void navigated(int page, float zoom) {
+        auto now = clock::now();
+        if (last_page >= 0 && page != last_page) {
+            int delta = page - last_page;
+            if (abs(delta) <= 2) {
+                direction = 0.7 * direction + 0.3 * (delta > 0 ? 1 : -1);
+                double seconds = std::chrono::duration<double>(now - last_turn).count();
+                seconds_per_turn = 0.7 * seconds_per_turn + 0.3 * std::min(seconds, 10.0);
+            }
+            last_turn = now;
+        } else if (last_page < 0) {
+            last_turn = now;
+        }
+        if (page == last_page && zoom != current.zoom) {
+            zoom_trend = 0.7 * zoom_trend + 0.3 * (zoom > current.zoom ? 1 : -1);
+        }
+        last_page = page;
+    }
+
+    // Renders that happen outside the prefetcher count towards how long
+    // pages take, too.
+    void rendered(double seconds) {
+        seconds_per_render = 0.7 * seconds_per_render + 0.3 * seconds;
+    }
+
+    // `step` is the number of pages shown at once; `max_zoom` is the highest
+    // zoom worth rendering a whole page at.
+    void schedule(int page, int step, float zoom, bool subpixel, float max_zoom) {
+        current = { page, step, zoom, subpixel, max_zoom };
+        plan();
+        update();
+    }
+
+    bool busy() const {
+        return !pending.empty();
+    }
+
+    // Calls off everything in flight. The jobs keep using the prefetcher
+    // until they notice, so the pool has to be idle before it's deleted.
+    void cancel() {
+        for (auto& [key, job] : pending) {
+            job.token->cancel();
+        }
+        targets.clear();
+    }
+
+    // Collects finished renders and starts new ones. Call once a frame.
+    void update() {
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second.result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++it;
+                continue;
+            }
+            try {
+                auto [image, seconds] = it->second.result.get();
+                rendered(seconds);
+                cache.insert(backend, it->first.page, it->first.zoom, it->first.subpixel, std::move(image));
+            } catch (const std::exception&) {
+                // it'll fail again, and be reported, if the page is shown.
+            }
+            it = pending.erase(it);
+        }
+
+        for (const RenderKey& key : targets) {
+            if (pending.size() >= pool.size()) {
+                break;
+            }
+            if (pending.contains(key) || cache.contains(backend, key.page, key.zoom, key.subpixel)) {
+                continue;
+            }
+            auto token = std::make_shared<RenderToken>();
+            auto result = pool.submit([this, key, token] {
+                auto t1 = clock::now();
+                auto image = buffers.acquire(backend->page_size(key.page, key.zoom));
+                backend->render_into(key.page, key.zoom, key.subpixel, sf::IntRect({ 0, 0 }, sf::Vector2i(image->size)), *image, token.get());
+                return std::pair(std::move(image), std::chrono::duration<double>(clock::now() - t1).count());
+            },
+                RenderPool::Priority::Background);
+            pending[key] = { std::move(result), token };
+        }
+    }
+};
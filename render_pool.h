@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+// A fixed set of worker threads that run render jobs. Backends are
+// thread-safe (see backends/backend.h), so jobs for different pages, such as
+// the two halves of a spread, run at the same time.
+//
+// Background jobs (prefetching) only start when no foreground job is queued,
+// so they never hold up the page the user is waiting for.
+class RenderPool {
+public:
+    enum class Priority {
+        Foreground,
+        Background,
+    };
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs, background_jobs;
+    std::mutex mutex;
+    std::condition_variable cv, idle;
+    size_t running = 0;
+    bool stopping = false;
+
+    void work() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [&] { return stopping || !jobs.empty() || !background_jobs.empty(); });
+                if (stopping && jobs.empty() && background_jobs.empty()) {
+                    return;
+                }
+                auto& queue = jobs.empty() ? background_jobs : jobs;
+                job = std::move(queue.front());
+                queue.pop_front();
+                running += 1;
+            }
+            job();
+            {
+                std::lock_guard lock(mutex);
+                running -= 1;
+            }
+            idle.notify_all();
+        }
+    }
+
+public:
+    RenderPool(unsigned int thread_count = std::max(2u, std::thread::hardware_concurrency())) {
+        for (unsigned int i = 0; i < thread_count; ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~RenderPool() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    template <typename F>
+    auto submit(F f, Priority priority = Priority::Foreground) -> std::future<decltype(f())> {
+        // std::function needs a copyable callable, packaged_task isn't one.
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+        auto result = task->get_future();
+        {
+            std::lock_guard lock(mutex);
+            auto& queue = priority == Priority::Foreground ? jobs : background_jobs;
+            queue.push_back([task] { (*task)(); });
+        }
+        cv.notify_one();
+        return result;
+    }
+
+    // Waits for every job, queued or running, to finish. Whoever calls this
+    // must have stopped submitting more first.
+    void wait_idle() {
+        std::unique_lock lock(mutex);
+        idle.wait(lock, [&] { return running == 0 && jobs.empty() && background_jobs.empty(); });
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+};
@@ -0,0 +1,81 @@
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <vector>
+
+#pragma once
+
+// Where each page sits when the document is shown as one long column, in
+// pixels at zoom 1. Pages are GAP apart and centred horizontally.
+//
+// Finding the pages in a stretch of the column is a binary search over the
+// page tops, so the viewer only ever touches the pages on screen however
+// long the document is. Until the real page sizes are known every page is
+// assumed to be the size of the first.
+class ScrollLayout {
+public:
+    static constexpr float GAP = 8;
+
+private:
+    std::vector<sf::Vector2f> sizes;
+    std::vector<float> tops; // one more than there are pages: the end of the column
+    float widest = 0;
+
+    void update() {
+        tops.resize(sizes.size() + 1);
+        float y = 0;
+        widest = 0;
+        for (int i = 0; i < sizes.size(); ++i) {
+            tops[i] = y;
+            y += sizes[i].y + GAP;
+            widest = std::max(widest, sizes[i].x);
+        }
+        tops[sizes.size()] = y;
+    }
+
+public:
+    ScrollLayout(int page_count, sf::Vector2f estimate)
+        : sizes(page_count, estimate) {
+        update();
+    }
+
+    void set_sizes(const std::vector<sf::Vector2f>& measured) {
+        std::copy_n(measured.begin(), std::min(measured.size(), sizes.size()), sizes.begin());
+        update();
+    }
+
+    int page_count() const {
+        return sizes.size();
+    }
+
+    float top(int page) const {
+        return tops[page];
+    }
+
+    sf::Vector2f size(int page) const {
+        return sizes[page];
+    }
+
+    float height() const {
+        return tops.back();
+    }
+
+    float width() const {
+        return widest;
+    }
+
+    // The page at height `y`, counting the gap below a page as part of it.
+    int page_at(float y) const {
+        int page = std::upper_bound(tops.begin(), tops.end() - 1, y) - tops.begin() - 1;
+        return std::clamp(page, 0, std::max(page_count() - 1, 0));
+    }
+
+    // Range of pages [lo, hi) that overlap heights [y0, y1).
+    std::pair<int, int> pages_between(float y0, float y1) const {
+        if (sizes.empty() || y1 <= 0 || y0 >= height()) {
+            return { 0, 0 };
+        }
+        int lo = page_at(y0);
+        int hi = std::lower_bound(tops.begin(), tops.end() - 1, y1) - tops.begin();
+        return { lo, std::max(hi, lo + 1) };
+    }
+};
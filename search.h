@@ -0,0 +1,226 @@
+#include "backends/backend.h"
+#include "render_pool.h"
+#include "text_index.h"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#pragma once
+
+struct SearchMatch {
+    int page;
+    std::vector<sf::FloatRect> boxes; // one per line the match spans, on the page at zoom 1
+};
+
+std::string lowercase(std::string s) {
+    // ASCII only; UTF-8 sequences pass through unchanged.
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+// Matches of `query`, which must already be lowercase, anywhere in the text
+// of `page`, ignoring case.
+std::vector<SearchMatch> find_matches(int page, const PageText& page_text, const std::string& query) {
+    std::vector<SearchMatch> matches;
+    if (query.empty()) {
+        return matches;
+    }
+    std::string text = lowercase(page_text.text);
+    for (size_t pos = text.find(query); pos != std::string::npos; pos = text.find(query, pos + query.size())) {
+        // join the boxes of characters on the same line.
+        SearchMatch match = { page, {} };
+        for (size_t i = pos; i < pos + query.size() && i < page_text.boxes.size(); ++i) {
+            sf::FloatRect box = page_text.boxes[i];
+            if (box.size.x <= 0 && box.size.y <= 0) {
+                continue;
+            }
+            float middle = box.position.y + box.size.y / 2;
+            if (!match.boxes.empty()) {
+                sf::FloatRect& line = match.boxes.back();
+                if (line.position.y <= middle && middle <= line.position.y + line.size.y) {
+                    sf::Vector2f lo = { std::min(line.position.x, box.position.x), std::min(line.position.y, box.position.y) };
+                    sf::Vector2f hi = {
+                        std::max(line.position.x + line.size.x, box.position.x + box.size.x),
+                        std::max(line.position.y + line.size.y, box.position.y + box.size.y),
+                    };
+                    line = sf::FloatRect(lo, hi - lo);
+                    continue;
+                }
+            }
+            match.boxes.push_back(box);
+        }
+        matches.push_back(std::move(match));
+    }
+    return matches;
+}
+
+// Searches the document's text on the render pool, a page at a time, as
+// background jobs so rendering comes first. Pages are taken in order going
+// outward from where the reader is, and matches are handed over as each
+// page finishes, so the nearest ones show up first. Starting a new search
+// calls off the old one.
+//
+// Once the document's text index is ready, only the pages it says could
+// match are searched, and their text comes from the index instead of the
+// backend.
+class Search {
+private:
+    // Shared with the jobs, which may still be finishing a page after the
+    // search they belong to has been replaced.
+    struct State {
+        std::string query;
+        std::vector<int> order; // pages, nearest first
+        const TextIndex* index = nullptr; // or null to extract the text
+        std::atomic<int> next = 0, searched = 0;
+        RenderToken token;
+        std::mutex mutex;
+        std::vector<SearchMatch> found; // not yet taken
+    };
+
+    Backend* backend;
+    RenderPool& pool;
+    const TextIndex* index;
+    std::shared_ptr<State> state;
+    mutable std::mutex jobs_mutex; // jobs queue their successors from the pool
+    std::vector<std::future<void>> jobs;
+
+    void submit(std::shared_ptr<State> state) {
+        std::lock_guard lock(jobs_mutex);
+        if (state->token.is_cancelled()) {
+            return;
+        }
+        std::erase_if(jobs, [](const auto& job) {
+            return job.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        jobs.push_back(pool.submit([this, state] { work(state); }, RenderPool::Priority::Background));
+    }
+
+    // Searches the next page in order, then queues a job for the one after,
+    // so renders get a worker between pages and prefetches aren't queued
+    // behind the whole document.
+    void work(const std::shared_ptr<State>& state) {
+        int i = state->next++;
+        if (state->token.is_cancelled() || i >= state->order.size()) {
+            return;
+        }
+        try {
+            PageText text = state->index ? state->index->page_text(state->order[i])
+                                         : backend->page_text(state->order[i], &state->token);
+            std::vector<SearchMatch> matches = find_matches(state->order[i], text, state->query);
+            std::lock_guard lock(state->mutex);
+            std::move(matches.begin(), matches.end(), std::back_inserter(state->found));
+        } catch (const RenderCancelled&) {
+            return;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+        state->searched += 1;
+        submit(state);
+    }
+
+public:
+    // `index` may be null.
+    Search(Backend* backend, RenderPool& pool, const TextIndex* index)
+        : backend { backend }
+        , pool { pool }
+        , index { index } { }
+
+    ~Search() {
+        // once cancelled, jobs don't queue any more.
+        cancel();
+        while (true) {
+            std::future<void> job;
+            {
+                std::lock_guard lock(jobs_mutex);
+                if (jobs.empty()) {
+                    break;
+                }
+                job = std::move(jobs.back());
+                jobs.pop_back();
+            }
+            job.wait();
+        }
+    }
+
+    void start(const std::string& query, int from_page) {
+        cancel();
+        state = std::make_shared<State>();
+        state->query = lowercase(query);
+
+        int page_count = backend->count_pages();
+        std::vector<bool> wanted(page_count, true);
+        if (index && index->ready()) {
+            state->index = index;
+            wanted.assign(page_count, false);
+            for (int page : index->candidates(query)) {
+                wanted[page] = true;
+            }
+        }
+        for (int i = 0; from_page + i < page_count || from_page - i >= 0; ++i) {
+            if (from_page + i < page_count && wanted[from_page + i]) {
+                state->order.push_back(from_page + i);
+            }
+            if (i > 0 && from_page - i >= 0 && wanted[from_page - i]) {
+                state->order.push_back(from_page - i);
+            }
+        }
+
+        // jobs of earlier searches may still be finishing a page; they're
+        // only forgotten once done, so the destructor waits for them too.
+        for (int i = 0; i < pool.size(); ++i) {
+            submit(state);
+        }
+    }
+
+    void cancel() {
+        if (state) {
+            state->token.cancel();
+        }
+    }
+
+    // Cancels the search and forgets its query and progress.
+    void reset() {
+        cancel();
+        state = nullptr;
+    }
+
+    bool cancelled() const {
+        return state && state->token.is_cancelled();
+    }
+
+    // Matches found since the last call.
+    std::vector<SearchMatch> take() {
+        if (!state) {
+            return {};
+        }
+        std::vector<SearchMatch> found;
+        std::lock_guard lock(state->mutex);
+        found.swap(state->found);
+        return found;
+    }
+
+    const std::string& query() const {
+        static const std::string none;
+        return state ? state->query : none;
+    }
+
+    // Pages searched so far, out of how many.
+    std::pair<int, int> progress() const {
+        return state ? std::pair<int, int>(state->searched, state->order.size()) : std::pair(0, 0);
+    }
+
+    bool busy() const {
+        std::lock_guard lock(jobs_mutex);
+        return std::any_of(jobs.begin(), jobs.end(), [](const auto& job) {
+            return job.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+        });
+    }
+};
@@ -0,0 +1,46 @@
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+#pragma once
+
+// Lock-free ring buffer for exactly one producer thread and one consumer
+// thread. Capacity is N, a power of two.
+template <typename T, size_t N>
+class SPSCQueue {
+private:
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+    T slots[N];
+    // Indices only ever grow; the slot is index % N. Each is written by one
+    // side only, and kept on its own cache line so they don't ping-pong.
+    alignas(64) std::atomic<size_t> head = 0; // next slot to pop, owned by the consumer
+    alignas(64) std::atomic<size_t> tail = 0; // next slot to push, owned by the producer
+
+public:
+    // Producer only. Leaves `value` untouched and returns false when full.
+    bool push(T&& value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        slots[t % N] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    bool pop(T& out) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        out = std::move(slots[h % N]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
@@ -0,0 +1,71 @@
+// Checks subpixel_row() against subpixel_row_reference() over widths that
+// hit every SIMD loop and its tail, and over ranges of output pixels as tiles
+// ask for them. Build and run with `make test`.
+
+#include "../backends/subpixel.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// subpixel_row() is fixed point and may differ from the floating point
+// reference by one where rounding lands just below a whole number.
+constexpr int TOLERANCE = 1;
+
+template <int N>
+int check(std::mt19937& rng, int w, int first, int count) {
+    std::vector<uint8_t> src(3 * N * w);
+    for (auto& byte : src) {
+        byte = rng();
+    }
+    std::vector<uint8_t> expected(4 * w), actual(4 * count + 64, 0xcd);
+    subpixel_row_reference<N>(src.data(), expected.data(), w);
+    subpixel_row<N>(src.data(), actual.data(), w, first, count);
+
+    int failures = 0;
+    for (int i = 0; i < 4 * count; ++i) {
+        if (std::abs(expected[4 * first + i] - actual[i]) > TOLERANCE) {
+            if (failures++ == 0) {
+                std::printf("N=%d w=%d first=%d count=%d: byte %d is %d, expected %d\n",
+                    N, w, first, count, i, actual[i], expected[4 * first + i]);
+            }
+        }
+    }
+    for (size_t i = 4 * count; i < actual.size(); ++i) {
+        if (actual[i] != 0xcd) {
+            std::printf("N=%d w=%d first=%d count=%d: wrote past the range at byte %zu\n", N, w, first, count, i);
+            return failures + 1;
+        }
+    }
+    return failures;
+}
+
+template <int N>
+int check_all(std::mt19937& rng) {
+    int failures = 0;
+    for (int w = 1; w <= 80; ++w) {
+        failures += check<N>(rng, w, 0, w) > 0;
+    }
+    for (int w : { 1000, 1023, 1024, 1025 }) {
+        failures += check<N>(rng, w, 0, w) > 0;
+    }
+    for (int i = 0; i < 2000; ++i) {
+        int w = 1 + rng() % 300;
+        int first = rng() % w;
+        int count = 1 + rng() % (w - first);
+        failures += check<N>(rng, w, first, count) > 0;
+    }
+    return failures;
+}
+
+int main() {
+    std::mt19937 rng(1);
+    int failures = check_all<3>(rng) + check_all<4>(rng);
+    if (failures > 0) {
+        std::printf("%d failing rows\n", failures);
+        return 1;
+    }
+    std::printf("subpixel_row matches the reference\n");
+    return 0;
+}
@@ -0,0 +1,459 @@
+#include "backends/backend.h"
+#include "render_pool.h"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#pragma once
+
+// A document's text and a trigram index over it, kept on disk so searching
+// again, in this session or a later one, doesn't extract anything.
+//
+// `<name>.text` holds a record per page: its text and the boxes of its
+// characters, quantized to 16 bits. Records are appended by background
+// jobs as pages are extracted, in whatever order they finish, so a build
+// that was interrupted picks up where it left off. Once every page is in,
+// `<name>.index` is written: where each page's record is, and for each
+// trigram of the lowercased text, the pages it occurs on. Both are then
+// mapped into memory, and a search only scans the text of the pages that
+// have every trigram of the query.
+class TextIndex {
+private:
+    struct Record {
+        uint32_t magic;
+        uint32_t page;
+        uint32_t length; // bytes of text, followed by 4 uint16_t per byte for the boxes
+        float scale_x, scale_y; // page units per box unit
+    };
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t page_count;
+        uint32_t trigram_count;
+        uint64_t text_size; // of the .text file it was built from
+    };
+    struct Trigram {
+        uint32_t key, first, count; // postings[first...first + count]
+    };
+    static constexpr uint32_t RECORD_MAGIC = 0x54564450; // "PDVT"
+    static constexpr char MAGIC[4] = { 'P', 'D', 'V', 'X' };
+    static constexpr uint32_t VERSION = 1;
+
+    std::filesystem::path text_path, index_path;
+    int page_count;
+
+    // building
+    std::mutex mutex;
+    int text_fd = -1;
+    uint64_t text_size = 0;
+    std::vector<int64_t> offsets; // of each page's record, or -1
+    std::vector<int> missing;
+    std::atomic<int> next = 0, remaining = 0;
+    RenderToken token;
+    std::mutex jobs_mutex; // jobs queue their successors from the pool
+    std::vector<std::future<void>> jobs;
+
+    // built
+    std::atomic<bool> is_ready = false;
+    const uint8_t* text_data = nullptr;
+    size_t text_map_size = 0;
+    const uint8_t* index_data = nullptr;
+    size_t index_map_size = 0;
+    const uint64_t* page_offsets;
+    const Trigram* trigrams;
+    uint32_t trigram_count;
+    const uint32_t* postings;
+
+    static size_t record_size(uint32_t length) {
+        return sizeof(Record) + (length + 3) / 4 * 4 + (size_t)length * 8;
+    }
+
+    static uint32_t trigram(const char* p) {
+        return (uint32_t)(uint8_t)p[0] << 16 | (uint32_t)(uint8_t)p[1] << 8 | (uint8_t)p[2];
+    }
+
+    static std::string lowercase(std::string s) {
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+        return s;
+    }
+
+    static const uint8_t* map(const std::filesystem::path& path, size_t& size) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = st.st_size;
+            data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        return data == MAP_FAILED ? nullptr : (const uint8_t*)data;
+    }
+
+    // Whether every page offset points at a whole record of that page in
+    // the text, and every trigram's postings lie in the file and name real
+    // pages, in order; searches use them unchecked.
+    bool tables_valid(const uint8_t* text, size_t text_bytes, const uint8_t* index, size_t index_bytes) const {
+        const Header* header = (const Header*)index;
+        const uint64_t* offsets = (const uint64_t*)(header + 1);
+        for (int page = 0; page < page_count; ++page) {
+            if (offsets[page] > text_bytes || text_bytes - offsets[page] < sizeof(Record)) {
+                return false;
+            }
+            const Record* record = (const Record*)(text + offsets[page]);
+            if (record->magic != RECORD_MAGIC || record->page != page
+                || text_bytes - offsets[page] < record_size(record->length)) {
+                return false;
+            }
+        }
+
+        const Trigram* table = (const Trigram*)(offsets + page_count);
+        const uint32_t* all_postings = (const uint32_t*)(table + header->trigram_count);
+        size_t posting_count = (index_bytes - ((const uint8_t*)all_postings - index)) / sizeof(uint32_t);
+        for (uint32_t i = 0; i < header->trigram_count; ++i) {
+            const Trigram& entry = table[i];
+            if (i > 0 && table[i - 1].key >= entry.key) {
+                return false;
+            }
+            if (entry.first > posting_count || posting_count - entry.first < entry.count) {
+                return false;
+            }
+            for (uint32_t j = 0; j < entry.count; ++j) {
+                uint32_t page = all_postings[entry.first + j];
+                if (page >= page_count || (j > 0 && all_postings[entry.first + j - 1] >= page)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Maps both files if the index is complete and matches the text.
+    bool open_index() {
+        size_t text_bytes, index_bytes;
+        const uint8_t* text = map(text_path, text_bytes);
+        const uint8_t* index = map(index_path, index_bytes);
+
+        const Header* header = (const Header*)index;
+        bool valid = text && index && index_bytes >= sizeof(Header)
+            && std::equal(MAGIC, MAGIC + 4, header->magic) && header->version == VERSION
+            && header->page_count == page_count && header->text_size == text_bytes
+            && index_bytes >= sizeof(Header) + page_count * sizeof(uint64_t) + (size_t)header->trigram_count * sizeof(Trigram)
+            && tables_valid(text, text_bytes, index, index_bytes);
+        if (!valid) {
+            if (text) {
+                munmap((void*)text, text_bytes);
+            }
+            if (index) {
+                munmap((void*)index, index_bytes);
+            }
+            return false;
+        }
+
+        text_data = text;
+        text_map_size = text_bytes;
+        index_data = index;
+        index_map_size = index_bytes;
+        page_offsets = (const uint64_t*)(header + 1);
+        trigrams = (const Trigram*)(page_offsets + page_count);
+        trigram_count = header->trigram_count;
+        postings = (const uint32_t*)(trigrams + trigram_count);
+        is_ready = true;
+        return true;
+    }
+
+    // Finds the records already in the text file, dropping a torn one at
+    // the end.
+    void scan_text() {
+        text_fd = open(text_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (text_fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(text_fd, &st) != 0) {
+            return;
+        }
+        uint64_t offset = 0;
+        Record record;
+        while (offset + sizeof(Record) <= st.st_size
+            && pread(text_fd, &record, sizeof(record), offset) == sizeof(record)
+            && record.magic == RECORD_MAGIC && record.page < page_count
+            && offset + record_size(record.length) <= st.st_size) {
+            offsets[record.page] = offset;
+            offset += record_size(record.length);
+        }
+        remaining = std::count(offsets.begin(), offsets.end(), -1);
+        if (offset != st.st_size && ftruncate(text_fd, offset) != 0) {
+            close(text_fd);
+            text_fd = -1;
+            return;
+        }
+        text_size = offset;
+    }
+
+    void append(int page, const PageText& page_text) {
+        Record record = { RECORD_MAGIC, (uint32_t)page, (uint32_t)page_text.text.size(), 1, 1 };
+        for (const sf::FloatRect& box : page_text.boxes) {
+            record.scale_x = std::max(record.scale_x, (box.position.x + box.size.x) / 65535);
+            record.scale_y = std::max(record.scale_y, (box.position.y + box.size.y) / 65535);
+        }
+
+        std::vector<uint8_t> bytes(record_size(record.length));
+        memcpy(bytes.data(), &record, sizeof(record));
+        memcpy(bytes.data() + sizeof(record), page_text.text.data(), record.length);
+        uint16_t* boxes = (uint16_t*)(bytes.data() + record_size(record.length) - (size_t)record.length * 8);
+        for (size_t i = 0; i < record.length; ++i) {
+            sf::FloatRect box = page_text.boxes[i];
+            boxes[i * 4 + 0] = std::clamp(std::floor(box.position.x / record.scale_x), 0.0f, 65535.0f);
+            boxes[i * 4 + 1] = std::clamp(std::floor(box.position.y / record.scale_y), 0.0f, 65535.0f);
+            boxes[i * 4 + 2] = std::clamp(std::ceil((box.position.x + box.size.x) / record.scale_x), 0.0f, 65535.0f);
+            boxes[i * 4 + 3] = std::clamp(std::ceil((box.position.y + box.size.y) / record.scale_y), 0.0f, 65535.0f);
+        }
+
+        std::lock_guard lock(mutex);
+        if (write(text_fd, bytes.data(), bytes.size()) != bytes.size()) {
+            throw std::runtime_error("can't write text index");
+        }
+        offsets[page] = text_size;
+        text_size += bytes.size();
+    }
+
+    template <typename F>
+    void submit(RenderPool& pool, F job) {
+        std::lock_guard lock(jobs_mutex);
+        if (token.is_cancelled()) {
+            return;
+        }
+        std::erase_if(jobs, [](const auto& job) {
+            return job.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        jobs.push_back(pool.submit(std::move(job), RenderPool::Priority::Background));
+    }
+
+    // Extracts the next missing page, then queues a job for the one after,
+    // so renders get a worker between pages however many there are; the
+    // last page to finish writes the index.
+    void extract(Backend* backend, RenderPool& pool) {
+        int i = next++;
+        if (token.is_cancelled() || i >= missing.size()) {
+            return;
+        }
+        try {
+            append(missing[i], backend->page_text(missing[i], &token));
+        } catch (const RenderCancelled&) {
+            return;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return; // the index stays incomplete until next time
+        }
+        if (--remaining == 0) {
+            finish();
+            return;
+        }
+        submit(pool, [this, backend, &pool] { extract(backend, pool); });
+    }
+
+    // Writes the index for a complete text file, under a temporary name
+    // renamed into place, then maps it.
+    void finish() {
+        size_t size;
+        const uint8_t* text = map(text_path, size);
+        if (!text) {
+            return;
+        }
+
+        std::unordered_map<uint32_t, std::vector<uint32_t>> pages_with;
+        for (int page = 0; page < page_count; ++page) {
+            const Record* record = (const Record*)(text + offsets[page]);
+            std::string lower = lowercase(std::string((const char*)(record + 1), record->length));
+            std::vector<uint32_t> keys;
+            for (size_t i = 0; i + 3 <= lower.size(); ++i) {
+                keys.push_back(trigram(&lower[i]));
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            for (uint32_t key : keys) {
+                pages_with[key].push_back(page);
+            }
+        }
+        munmap((void*)text, size);
+
+        std::vector<Trigram> table;
+        std::vector<uint32_t> all_postings;
+        for (auto& [key, pages] : pages_with) {
+            table.push_back({ key, 0, (uint32_t)pages.size() });
+        }
+        std::sort(table.begin(), table.end(), [](const Trigram& a, const Trigram& b) { return a.key < b.key; });
+        for (Trigram& entry : table) {
+            entry.first = all_postings.size();
+            const auto& pages = pages_with[entry.key];
+            all_postings.insert(all_postings.end(), pages.begin(), pages.end());
+        }
+
+        std::vector<uint64_t> page_table(offsets.begin(), offsets.end());
+        Header header = { { MAGIC[0], MAGIC[1], MAGIC[2], MAGIC[3] }, VERSION, (uint32_t)page_count, (uint32_t)table.size(), size };
+        std::filesystem::path tmp = index_path;
+        tmp += ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            out.write((const char*)&header, sizeof(header));
+            out.write((const char*)page_table.data(), page_table.size() * sizeof(uint64_t));
+            out.write((const char*)table.data(), table.size() * sizeof(Trigram));
+            out.write((const char*)all_postings.data(), all_postings.size() * sizeof(uint32_t));
+            if (!out) {
+                std::error_code ec;
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, index_path, ec);
+        if (!ec) {
+            open_index();
+        }
+    }
+
+public:
+    // The files are `base` with .text and .index appended.
+    TextIndex(const std::filesystem::path& base, int page_count)
+        : page_count { page_count }
+        , offsets(page_count, -1) {
+        text_path = index_path = base;
+        text_path += ".text";
+        index_path += ".index";
+
+        std::error_code ec;
+        std::filesystem::create_directories(base.parent_path(), ec);
+        if (!open_index()) {
+            scan_text();
+        }
+    }
+
+    ~TextIndex() {
+        // once cancelled, jobs don't queue any more.
+        token.cancel();
+        while (true) {
+            std::future<void> job;
+            {
+                std::lock_guard lock(jobs_mutex);
+                if (jobs.empty()) {
+                    break;
+                }
+                job = std::move(jobs.back());
+                jobs.pop_back();
+            }
+            job.wait();
+        }
+        if (text_fd >= 0) {
+            close(text_fd);
+        }
+        if (text_data) {
+            munmap((void*)text_data, text_map_size);
+        }
+        if (index_data) {
+            munmap((void*)index_data, index_map_size);
+        }
+    }
+
+    TextIndex(const TextIndex&) = delete;
+    TextIndex& operator=(const TextIndex&) = delete;
+
+    // Extracts the pages not in the text file yet with background jobs, at
+    // most half the pool's worth at once so prefetching can still run, then
+    // writes the index.
+    void build(Backend* backend, RenderPool& pool) {
+        if (is_ready || text_fd < 0) {
+            return;
+        }
+        for (int page = 0; page < page_count; ++page) {
+            if (offsets[page] < 0) {
+                missing.push_back(page);
+            }
+        }
+        if (missing.empty()) {
+            submit(pool, [this] { finish(); });
+            return;
+        }
+
+        for (int i = 0; i < std::max(1, (int)pool.size() / 2); ++i) {
+            submit(pool, [this, backend, &pool] { extract(backend, pool); });
+        }
+    }
+
+    bool ready() const {
+        return is_ready;
+    }
+
+    // Pages extracted so far, out of how many.
+    std::pair<int, int> progress() const {
+        return { is_ready ? page_count : page_count - (int)remaining, page_count };
+    }
+
+    // The pages, in order, that have every trigram of `query`: all pages
+    // the query could be on. Only once ready().
+    std::vector<int> candidates(const std::string& query) const {
+        std::vector<int> pages;
+        std::string lower = lowercase(query);
+        if (lower.size() < 3) {
+            for (int page = 0; page < page_count; ++page) {
+                pages.push_back(page);
+            }
+            return pages;
+        }
+
+        for (size_t i = 0; i + 3 <= lower.size(); ++i) {
+            uint32_t key = trigram(&lower[i]);
+            const Trigram* end = trigrams + trigram_count;
+            const Trigram* it = std::lower_bound(trigrams, end, key, [](const Trigram& t, uint32_t key) { return t.key < key; });
+            if (it == end || it->key != key) {
+                return {};
+            }
+            const uint32_t* first = postings + it->first;
+            if (i == 0) {
+                pages.assign(first, first + it->count);
+                continue;
+            }
+            std::vector<int> both;
+            std::set_intersection(pages.begin(), pages.end(), first, first + it->count, std::back_inserter(both));
+            pages = std::move(both);
+            if (pages.empty()) {
+                break;
+            }
+        }
+        return pages;
+    }
+
+    // The stored text of `page`. Only once ready().
+    PageText page_text(int page) const {
+        const Record* record = (const Record*)(text_data + page_offsets[page]);
+        PageText page_text;
+        page_text.text.assign((const char*)(record + 1), record->length);
+        const uint16_t* boxes = (const uint16_t*)((const uint8_t*)record + record_size(record->length) - (size_t)record->length * 8);
+        page_text.boxes.reserve(record->length);
+        for (size_t i = 0; i < record->length; ++i) {
+            float x0 = boxes[i * 4 + 0] * record->scale_x, y0 = boxes[i * 4 + 1] * record->scale_y;
+            float x1 = boxes[i * 4 + 2] * record->scale_x, y1 = boxes[i * 4 + 3] * record->scale_y;
+            page_text.boxes.push_back(sf::FloatRect({ x0, y0 }, { x1 - x0, y1 - y0 }));
+        }
+        return page_text;
+    }
+};
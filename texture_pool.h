@@ -0,0 +1,205 @@
+#include "backends/pixel_buffer.h"
+
+#include <SFML/Graphics.hpp>
+#include <SFML/OpenGL.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#pragma once
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#define GL_PIXEL_UNPACK_BUFFER_BINDING 0x88EF
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#define GL_WRITE_ONLY 0x88B9
+#endif
+
+// Textures for whole pages. Creating a texture per page churns GPU memory,
+// so textures go back to the pool when the last reference is dropped and
+// are handed out again for any page that fits; the sprite drawing one shows
+// only the part in use. Sizes are rounded up so pages of about the same size
+// share textures.
+//
+// Uploads go through a pixel buffer object when the driver has them: the
+// pixels are copied into driver memory and glTexSubImage2D returns at once,
+// the transfer to the texture overlapping whatever the frame draws next.
+//
+// Only to be used from the thread that owns the window's GL context, and
+// must outlive the textures it hands out.
+class TexturePool {
+public:
+    struct Stats {
+        size_t textures = 0, bytes = 0; // all textures made, in use or idle
+        size_t uploads = 0;
+        double last_upload_ms = 0, average_upload_ms = 0;
+        bool async = false;
+    };
+
+private:
+    static constexpr unsigned int GRANULARITY = 256;
+
+    std::vector<std::unique_ptr<sf::Texture>> idle;
+    size_t max_idle;
+    Stats counters;
+
+    // GL 2.1 entry points, which SFML doesn't expose.
+    using GenBuffers = void (*)(GLsizei, GLuint*);
+    using DeleteBuffers = void (*)(GLsizei, const GLuint*);
+    using BindBuffer = void (*)(GLenum, GLuint);
+    using BufferData = void (*)(GLenum, ptrdiff_t, const void*, GLenum);
+    using MapBuffer = void* (*)(GLenum, GLenum);
+    using UnmapBuffer = GLboolean (*)(GLenum);
+    GenBuffers glGenBuffers_ = nullptr;
+    DeleteBuffers glDeleteBuffers_ = nullptr;
+    BindBuffer glBindBuffer_ = nullptr;
+    BufferData glBufferData_ = nullptr;
+    MapBuffer glMapBuffer_ = nullptr;
+    UnmapBuffer glUnmapBuffer_ = nullptr;
+    GLuint pbo = 0;
+    bool initialized = false;
+
+    void init() {
+        initialized = true;
+        if (!sf::Context::isExtensionAvailable("GL_ARB_pixel_buffer_object")) {
+            return;
+        }
+        glGenBuffers_ = (GenBuffers)sf::Context::getFunction("glGenBuffers");
+        glDeleteBuffers_ = (DeleteBuffers)sf::Context::getFunction("glDeleteBuffers");
+        glBindBuffer_ = (BindBuffer)sf::Context::getFunction("glBindBuffer");
+        glBufferData_ = (BufferData)sf::Context::getFunction("glBufferData");
+        glMapBuffer_ = (MapBuffer)sf::Context::getFunction("glMapBuffer");
+        glUnmapBuffer_ = (UnmapBuffer)sf::Context::getFunction("glUnmapBuffer");
+        if (glGenBuffers_ && glDeleteBuffers_ && glBindBuffer_ && glBufferData_ && glMapBuffer_ && glUnmapBuffer_) {
+            glGenBuffers_(1, &pbo);
+        }
+        counters.async = pbo != 0;
+    }
+
+    static unsigned int round_up(unsigned int n) {
+        return (std::max(n, 1u) + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
+    }
+
+    static size_t cost(sf::Vector2u size) {
+        return (size_t)size.x * size.y * 4;
+    }
+
+public:
+    TexturePool(size_t max_idle)
+        : max_idle { max_idle } { }
+
+    ~TexturePool() {
+        if (pbo) {
+            glDeleteBuffers_(1, &pbo);
+        }
+    }
+
+    std::shared_ptr<sf::Texture> acquire(sf::Vector2u size) {
+        // the smallest idle texture that fits, unless it's over twice as big.
+        auto best = idle.end();
+        for (auto it = idle.begin(); it != idle.end(); ++it) {
+            sf::Vector2u have = (*it)->getSize();
+            if (have.x >= size.x && have.y >= size.y && cost(have) <= 2 * cost(size)
+                && (best == idle.end() || cost(have) < cost((*best)->getSize()))) {
+                best = it;
+            }
+        }
+
+        std::unique_ptr<sf::Texture> texture;
+        if (best != idle.end()) {
+            texture = std::move(*best);
+            idle.erase(best);
+        } else {
+            texture = std::make_unique<sf::Texture>(sf::Vector2u { round_up(size.x), round_up(size.y) });
+            counters.textures += 1;
+            counters.bytes += cost(texture->getSize());
+        }
+
+        return std::shared_ptr<sf::Texture>(texture.release(),
+            [this](sf::Texture* texture) {
+                if (idle.size() < max_idle) {
+                    idle.emplace_back(texture);
+                } else {
+                    counters.textures -= 1;
+                    counters.bytes -= cost(texture->getSize());
+                    delete texture;
+                }
+            });
+    }
+
+private:
+    // Smooth sampling at the right and bottom edges of the image blends in
+    // the texels just past them, which hold whatever the texture was last
+    // used for; copy the last column and row there instead.
+    static void replicate_edges(sf::Texture& texture, const PixelBuffer& image) {
+        sf::Vector2u size = texture.getSize();
+        if (image.size.x == 0 || image.size.y == 0) {
+            return;
+        }
+        if (image.size.x < size.x) {
+            std::vector<uint8_t> column((size_t)image.size.y * 4);
+            for (unsigned int y = 0; y < image.size.y; ++y) {
+                memcpy(&column[y * 4], image.row(y) + (image.size.x - 1) * 4, 4);
+            }
+            texture.update(column.data(), { 1, image.size.y }, { image.size.x, 0 });
+        }
+        if (image.size.y < size.y) {
+            unsigned int width = std::min(image.size.x + 1, size.x);
+            std::vector<uint8_t> row((size_t)width * 4);
+            memcpy(row.data(), image.row(image.size.y - 1), (size_t)image.size.x * 4);
+            if (width > image.size.x) {
+                memcpy(&row[image.size.x * 4], image.row(image.size.y - 1) + (image.size.x - 1) * 4, 4);
+            }
+            texture.update(row.data(), { width, 1 }, { 0, image.size.y });
+        }
+    }
+
+public:
+    // Copies `image` (with packed rows) into the top-left of `texture`.
+    void upload(sf::Texture& texture, const PixelBuffer& image) {
+        if (!initialized) {
+            init();
+        }
+        auto t1 = std::chrono::steady_clock::now();
+
+        bool done = false;
+        if (pbo) {
+            GLint bound_texture = 0, bound_buffer = 0;
+            glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound_texture);
+            glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &bound_buffer);
+
+            // orphan the buffer's old storage rather than wait for the last
+            // upload from it to finish.
+            glBindBuffer_(GL_PIXEL_UNPACK_BUFFER, pbo);
+            glBufferData_(GL_PIXEL_UNPACK_BUFFER, image.bytes(), nullptr, GL_STREAM_DRAW);
+            if (void* mapped = glMapBuffer_(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY)) {
+                memcpy(mapped, image.pixels, image.bytes());
+                if (glUnmapBuffer_(GL_PIXEL_UNPACK_BUFFER)) {
+                    glBindTexture(GL_TEXTURE_2D, texture.getNativeHandle());
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.size.x, image.size.y, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+                    done = true;
+                }
+            }
+
+            glBindBuffer_(GL_PIXEL_UNPACK_BUFFER, bound_buffer);
+            glBindTexture(GL_TEXTURE_2D, bound_texture);
+        }
+        if (!done) {
+            texture.update(image.pixels, image.size, { 0, 0 });
+        }
+        replicate_edges(texture, image);
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+        counters.uploads += 1;
+        counters.last_upload_ms = ms;
+        counters.average_upload_ms += (ms - counters.average_upload_ms) / std::min<size_t>(counters.uploads, 32);
+    }
+
+    Stats stats() const {
+        return counters;
+    }
+};
@@ -0,0 +1,221 @@
+#include "backends/backend.h"
+#include "render_pool.h"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <fcntl.h>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#pragma once
+
+// Small renders of every page for the grid overview. They're made by
+// background jobs on the render pool and packed into a few large atlas
+// textures, so the grid draws from a handful of textures however many pages
+// the document has.
+//
+// Thumbnails are rendered straight into a file mapped into memory, one
+// fixed-size record per page, that lives with the document's disk cache;
+// reopening the document finds them there and only uploads them. If the
+// file can't be made they're kept in anonymous memory instead.
+class Thumbnails {
+public:
+    // The box a thumbnail is fitted into.
+    static constexpr unsigned int WIDTH = 96, HEIGHT = 128;
+
+private:
+    static constexpr unsigned int ATLAS_SIZE = 2048;
+    static constexpr unsigned int COLUMNS = ATLAS_SIZE / WIDTH;
+    static constexpr unsigned int PER_ATLAS = COLUMNS * (ATLAS_SIZE / HEIGHT);
+    // keeps a frame from stalling on a document's worth of uploads.
+    static constexpr int UPLOADS_PER_UPDATE = 32;
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t page_count;
+        uint32_t width, height;
+        uint32_t reserved[3];
+    };
+    struct Record {
+        uint32_t width, height; // 0 until rendered
+        uint8_t pixels[WIDTH * HEIGHT * 4]; // packed rows of `width` pixels
+    };
+    static constexpr char MAGIC[4] = { 'P', 'D', 'V', 'T' };
+    static constexpr uint32_t VERSION = 1;
+
+    Backend* backend;
+    RenderPool& pool;
+    int page_count;
+
+    void* data = MAP_FAILED;
+    size_t data_size;
+    Record* records;
+
+    std::vector<bool> uploaded;
+    std::vector<bool> failed; // not retried until the document is reopened
+    std::vector<std::unique_ptr<sf::Texture>> atlases;
+    struct Pending {
+        std::future<void> done;
+        std::shared_ptr<RenderToken> token;
+    };
+    std::map<int, Pending> pending;
+
+    sf::IntRect slot(int page) const {
+        int i = page % PER_ATLAS;
+        return sf::IntRect({ (int)(i % COLUMNS * WIDTH), (int)(i / COLUMNS * HEIGHT) },
+            { (int)records[page].width, (int)records[page].height });
+    }
+
+    void upload(int page) {
+        auto& atlas = atlases[page / PER_ATLAS];
+        if (!atlas) {
+            atlas = std::make_unique<sf::Texture>(sf::Vector2u { ATLAS_SIZE, ATLAS_SIZE });
+            atlas->setSmooth(true);
+        }
+        sf::IntRect rect = slot(page);
+        atlas->update(records[page].pixels, sf::Vector2u(rect.size), sf::Vector2u(rect.position));
+        uploaded[page] = true;
+    }
+
+    void submit(int page) {
+        auto token = std::make_shared<RenderToken>();
+        Record* record = &records[page];
+        // measured and rendered without going through the backend's caches,
+        // which are for the pages being read.
+        auto done = pool.submit([backend = backend, page, record, token] {
+            sf::Vector2f full = backend->measure_page(page);
+            if (full.x < 1 || full.y < 1) {
+                throw std::runtime_error("page " + std::to_string(page) + " is empty");
+            }
+            float zoom = std::min(WIDTH / full.x, HEIGHT / full.y);
+            sf::Vector2u size = { (unsigned int)(full.x * zoom), (unsigned int)(full.y * zoom) };
+            size = { std::clamp(size.x, 1u, WIDTH), std::clamp(size.y, 1u, HEIGHT) };
+            PixelBuffer out = { size, (size_t)size.x * 4, record->pixels };
+            backend->render_thumbnail(page, zoom, sf::IntRect({ 0, 0 }, sf::Vector2i(size)), out, token.get());
+            record->height = size.y;
+            record->width = size.x;
+        },
+            RenderPool::Priority::Background);
+        pending[page] = { std::move(done), token };
+    }
+
+public:
+    // `path` may be empty, for no file.
+    Thumbnails(Backend* backend, RenderPool& pool, const std::filesystem::path& path)
+        : backend { backend }
+        , pool { pool }
+        , page_count { backend->count_pages() }
+        , uploaded(page_count)
+        , failed(page_count) {
+        data_size = sizeof(Header) + (size_t)page_count * sizeof(Record);
+
+        int fd = path.empty() ? -1 : open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            // start over if the file is for another layout or is damaged.
+            Header header;
+            struct stat st;
+            bool valid = fstat(fd, &st) == 0 && st.st_size == data_size
+                && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                && std::equal(MAGIC, MAGIC + 4, header.magic) && header.version == VERSION
+                && header.page_count == page_count && header.width == WIDTH && header.height == HEIGHT;
+            if (!valid) {
+                header = { { MAGIC[0], MAGIC[1], MAGIC[2], MAGIC[3] }, VERSION, (uint32_t)page_count, WIDTH, HEIGHT, {} };
+                valid = ftruncate(fd, 0) == 0 && ftruncate(fd, data_size) == 0
+                    && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+            }
+            if (valid) {
+                data = mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+        }
+        if (data == MAP_FAILED) {
+            data = mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("can't allocate thumbnails");
+        }
+        records = (Record*)((char*)data + sizeof(Header));
+        atlases.resize((page_count + PER_ATLAS - 1) / PER_ATLAS);
+    }
+
+    ~Thumbnails() {
+        // the jobs write into the mapping.
+        for (auto& [page, job] : pending) {
+            job.token->cancel();
+        }
+        for (auto& [page, job] : pending) {
+            job.done.wait();
+        }
+        munmap(data, data_size);
+    }
+
+    Thumbnails(const Thumbnails&) = delete;
+    Thumbnails& operator=(const Thumbnails&) = delete;
+
+    // Uploads thumbnails that are ready, from the file or from finished
+    // jobs, and queues renders of missing ones: pages [lo, hi), the ones on
+    // screen, first and then the rest in order. Returns whether any
+    // thumbnail was uploaded.
+    bool update(int lo, int hi) {
+        bool changed = false;
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second.done.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++it;
+                continue;
+            }
+            try {
+                it->second.done.get();
+            } catch (const RenderCancelled&) {
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                failed[it->first] = true;
+            }
+            it = pending.erase(it);
+        }
+
+        int uploads = 0;
+        auto want = [&](int page) {
+            if (uploaded[page] || failed[page] || pending.contains(page)) {
+                return;
+            }
+            if (records[page].width == 0) {
+                if (pending.size() < pool.size()) {
+                    submit(page);
+                }
+            } else if (uploads < UPLOADS_PER_UPDATE) {
+                upload(page);
+                uploads += 1;
+                changed = true;
+            }
+        };
+        for (int page = std::max(lo, 0); page < std::min(hi, page_count); ++page) {
+            want(page);
+        }
+        for (int page = 0; page < page_count && (pending.size() < pool.size() || uploads < UPLOADS_PER_UPDATE); ++page) {
+            want(page);
+        }
+        return changed;
+    }
+
+    // The thumbnail of `page`, or nothing if it isn't ready yet.
+    std::optional<sf::Sprite> sprite(int page) const {
+        if (!uploaded[page]) {
+            return std::nullopt;
+        }
+        return sf::Sprite(*atlases[page / PER_ATLAS], slot(page));
+    }
+
+    bool busy() const {
+        return !pending.empty();
+    }
+};
@@ -0,0 +1,57 @@
+#include "backends/pixel_buffer.h"
+
+#include <SFML/Graphics.hpp>
+#include <list>
+#include <map>
+
+#pragma once
+
+struct TileKey {
+    int page;
+    float zoom;
+    bool subpixel;
+    int x, y; // column and row of the tile within the page
+
+    auto operator<=>(const TileKey&) const = default;
+};
+
+// Textures for the fixed-size tiles a deeply zoomed page is drawn with.
+// Holds at most `capacity` tiles, dropping the least recently used.
+class TileCache {
+private:
+    std::list<std::pair<TileKey, sf::Texture>> tiles; // most recent first
+    std::map<TileKey, decltype(tiles)::iterator> index;
+    size_t capacity;
+
+public:
+    TileCache(size_t capacity)
+        : capacity { capacity } { }
+
+    const sf::Texture* find(const TileKey& key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        tiles.splice(tiles.begin(), tiles, it->second);
+        return &it->second->second;
+    }
+
+    bool contains(const TileKey& key) const {
+        return index.contains(key);
+    }
+
+    // `image` must have packed rows.
+    void insert(const TileKey& key, const PixelBuffer& image) {
+        if (auto it = index.find(key); it != index.end()) {
+            tiles.erase(it->second);
+            index.erase(it);
+        }
+        while (!tiles.empty() && tiles.size() >= capacity) {
+            index.erase(tiles.back().first);
+            tiles.pop_back();
+        }
+        sf::Texture& texture = tiles.emplace_front(key, sf::Texture(image.size)).second;
+        texture.update(image.pixels);
+        index[key] = tiles.begin();
+    }
+};